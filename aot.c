@@ -0,0 +1,601 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 18:31:40
+
+#include <setjmp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <mush/cursor.h>
+
+#include "aot.h"
+#include "stack.h"
+
+// Beyond these the program is considered too large to be worth compiling.
+enum { MAX_NODES = 1 << 20, MAX_G_AREA = 1 << 20 };
+
+typedef struct {
+   mushcoords2 pos, delta;
+   cell i;
+
+   // The successors. Which is which depends on the instruction: see emit().
+   size_t next[3];
+
+   // For ' the value pushed; for " the string pushed, in order.
+   cell value;
+   cell *str;
+   size_t str_len;
+
+   // The fewest cells the stack can hold on reaching this node.
+   size_t depth;
+} Node;
+
+static Node *nodes;
+static size_t nodes_len, nodes_cap;
+
+// Open addressing index into nodes: indices plus one, zero meaning empty.
+static size_t *index_tab, index_cap;
+
+static mushspace2 *space;
+static mushcursor2 *cursor;
+static jmp_buf jmp;
+
+static void handler(musherr err, void *unused, void *unused2) {
+   (void)unused;
+   (void)unused2;
+   switch (err) {
+   case MUSHERR_INFINITE_LOOP_SPACES:
+   case MUSHERR_INFINITE_LOOP_SEMICOLONS:
+      longjmp(jmp, 1);
+   default: break;
+   }
+}
+
+static size_t hash(mushcoords2 pos, mushcoords2 delta) {
+   uint64_t h = (uint64_t)pos.x   * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)pos.y   * 0xc2b2ae3d27d4eb4fu
+              ^ (uint64_t)delta.x * 0x165667b19e3779f9u
+              ^ (uint64_t)delta.y * 0x27d4eb2f165667c5u;
+   return h ^ h >> 29;
+}
+
+static size_t *find(mushcoords2 pos, mushcoords2 delta) {
+   for (size_t i = hash(pos, delta) & (index_cap - 1);;
+        i = (i + 1) & (index_cap - 1))
+   {
+      const size_t j = index_tab[i];
+      if (!j)
+         return &index_tab[i];
+      const Node *n = &nodes[j-1];
+      if (n->pos.x == pos.x && n->pos.y == pos.y
+       && n->delta.x == delta.x && n->delta.y == delta.y)
+         return &index_tab[i];
+   }
+}
+
+// Returns the node for the instruction at pos executed with delta, adding it
+// if it's new. Returns SIZE_MAX if there are too many.
+static size_t node(mushcoords2 pos, mushcoords2 delta, cell i) {
+   if (2 * (nodes_len + 1) > index_cap) {
+      free(index_tab);
+      index_cap = index_cap ? 2 * index_cap : 1024;
+      index_tab = calloc(index_cap, sizeof *index_tab);
+      for (size_t j = 0; j < nodes_len; ++j)
+         *find(nodes[j].pos, nodes[j].delta) = j + 1;
+   }
+
+   size_t *slot = find(pos, delta);
+   if (*slot)
+      return *slot - 1;
+   if (nodes_len == MAX_NODES)
+      return SIZE_MAX;
+
+   if (nodes_len == nodes_cap) {
+      nodes_cap = nodes_cap ? 2 * nodes_cap : 256;
+      nodes = realloc(nodes, nodes_cap * sizeof *nodes);
+   }
+
+   Node *n = &nodes[nodes_len];
+   memset(n, 0, sizeof *n);
+   n->pos   = pos;
+   n->delta = delta;
+   n->i     = i;
+   *slot = ++nodes_len;
+   return nodes_len - 1;
+}
+
+// The node reached by advancing the given number of times from pos and then
+// skipping spaces and semicolons, as the main loop does.
+static size_t step(mushcoords2 pos, mushcoords2 delta, int advances) {
+   mushcursor2_set_pos(cursor, pos);
+   while (advances--)
+      mushcursor2_advance(cursor, delta);
+   cell i;
+   mushcursor2_skip_markers(cursor, delta, &i);
+   return node(mushcursor2_get_pos(cursor), delta, i);
+}
+
+static mushcoords2 turn_left(mushcoords2 d)  { return MUSHCOORDS2( d.y,-d.x); }
+static mushcoords2 turn_right(mushcoords2 d) { return MUSHCOORDS2(-d.y, d.x); }
+static mushcoords2 reverse(mushcoords2 d)    { return MUSHCOORDS2(-d.x,-d.y); }
+
+// Reads the string of a " at pos as stringmode does, returning the position
+// of the closing ".
+static mushcoords2 string(Node *n) {
+   size_t cap = 0;
+   mushcursor2_set_pos(cursor, n->pos);
+   mushcursor2_advance(cursor, n->delta);
+   for (;;) {
+      cell c;
+      mushcursor2_skip_to_last_space(cursor, n->delta, &c);
+      if (c == '"')
+         return mushcursor2_get_pos(cursor);
+      if (n->str_len == cap) {
+         cap = cap ? 2 * cap : 16;
+         n->str = realloc(n->str, cap * sizeof *n->str);
+      }
+      n->str[n->str_len++] = c;
+      mushcursor2_advance(cursor, n->delta);
+   }
+}
+
+static bool uses_g;
+
+// Finds the successors of every node, adding them as they're found. Returns
+// the index of a node whose instruction can't be compiled, or SIZE_MAX.
+static size_t explore(void) {
+   for (size_t k = 0; k < nodes_len; ++k) {
+      // Copied since adding nodes may move them.
+      Node n = nodes[k];
+      mushcoords2 d = n.delta;
+      size_t *next = n.next;
+
+      switch (n.i) {
+      case '>': next[0] = step(n.pos, MUSHCOORDS2( 1, 0), 1); break;
+      case '<': next[0] = step(n.pos, MUSHCOORDS2(-1, 0), 1); break;
+      case '^': next[0] = step(n.pos, MUSHCOORDS2( 0,-1), 1); break;
+      case 'v': next[0] = step(n.pos, MUSHCOORDS2( 0, 1), 1); break;
+      case '[': next[0] = step(n.pos, turn_left(d),       1); break;
+      case ']': next[0] = step(n.pos, turn_right(d),      1); break;
+
+      case '#': next[0] = step(n.pos, d, 2); break;
+      case '\'':
+         mushcursor2_set_pos(cursor, n.pos);
+         mushcursor2_advance(cursor, d);
+         n.value = mushcursor2_get(cursor);
+         next[0] = step(n.pos, d, 2);
+         break;
+
+      case '@': break;
+
+      case '_':
+         next[0] = step(n.pos, MUSHCOORDS2( 1,0), 1);
+         next[1] = step(n.pos, MUSHCOORDS2(-1,0), 1);
+         break;
+      case '|':
+         next[0] = step(n.pos, MUSHCOORDS2(0, 1), 1);
+         next[1] = step(n.pos, MUSHCOORDS2(0,-1), 1);
+         break;
+      case 'w':
+         next[0] = step(n.pos, d,             1);
+         next[1] = step(n.pos, turn_left(d),  1);
+         next[2] = step(n.pos, turn_right(d), 1);
+         break;
+
+      case '&': case '~':
+         next[0] = step(n.pos, d,          1);
+         next[1] = step(n.pos, reverse(d), 1);
+         break;
+
+      case '"':
+         next[0] = step(string(&n), d, 1);
+         break;
+
+      case 'g': uses_g = true; // fallthrough
+      case '0': case '1': case '2': case '3': case '4':
+      case '5': case '6': case '7': case '8': case '9':
+      case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+      case '+': case '-': case '*': case '/': case '%': case '!': case '`':
+      case ':': case '\\': case '$': case 'n': case '.': case ',': case 'y':
+      case 'z':
+         next[0] = step(n.pos, d, 1);
+         break;
+
+      // Self-modification, movement that depends on the stack, and things
+      // that need state we don't track. Without { there's never a stack
+      // stack, and without ( the STRN instructions are never loaded, so } u
+      // and those reflect like any unknown instruction.
+      case 'p': case 's': case 'k': case 'j': case 'x': case '{': case '(':
+      case 'i': case 'o':
+         return k;
+
+      default:
+         next[0] = step(n.pos, reverse(d), 1);
+         break;
+      }
+
+      nodes[k] = n;
+      for (int i = 0; i < 3; ++i)
+         if (next[i] == SIZE_MAX)
+            return k;
+   }
+   return SIZE_MAX;
+}
+
+static size_t successors(cell i) {
+   switch (i) {
+   case '@': return 0;
+   case '_': case '|': case '&': case '~': return 2;
+   case 'w': return 3;
+   default: return 1;
+   }
+}
+
+// The number of cells the instruction pops, and pushes when continuing to
+// the given successor. n is left for the caller.
+static void stack_effect(
+   const Node *n, size_t succ, size_t *pops, size_t *pushes)
+{
+   *pops = *pushes = 0;
+   switch (n->i) {
+   case '0': case '1': case '2': case '3': case '4':
+   case '5': case '6': case '7': case '8': case '9':
+   case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case '\'':
+      *pushes = 1;
+      break;
+   case '"': *pushes = n->str_len; break;
+   case '&': case '~': *pushes = succ == 0; break;
+
+   case '+': case '-': case '*': case '/': case '%': case '`': case 'g':
+      *pops = 2; *pushes = 1;
+      break;
+   case '\\': *pops = 2; *pushes = 2; break;
+   case ':':  *pops = 1; *pushes = 2; break;
+   case '!':  *pops = 1; *pushes = 1; break;
+   case 'w':  *pops = 2; break;
+
+   // y pushes nothing for most arguments.
+   case '$': case '_': case '|': case '.': case ',': case 'y':
+      *pops = 1;
+      break;
+   }
+}
+
+// Every pop must check for an empty stack, since Befunge defines popping one
+// to give zero. But the fewest cells the stack can hold at each node can be
+// found by following the edges from the start until nothing changes, and
+// pops that are thereby known to find a cell can skip the check.
+static void find_depths(void) {
+   size_t *work = malloc(nodes_len * sizeof *work), work_len = 0;
+   bool *queued = calloc(nodes_len, sizeof *queued);
+   for (size_t k = 0; k < nodes_len; ++k)
+      nodes[k].depth = SIZE_MAX;
+
+   nodes[0].depth = 0;
+   work[work_len++] = 0;
+   queued[0] = true;
+   while (work_len) {
+      const size_t k = work[--work_len];
+      const Node *n = &nodes[k];
+      queued[k] = false;
+
+      for (size_t i = 0; i < successors(n->i); ++i) {
+         size_t pops, pushes;
+         stack_effect(n, i, &pops, &pushes);
+         size_t d = n->i == 'n' ? 0
+                  : (n->depth > pops ? n->depth - pops : 0) + pushes;
+
+         Node *m = &nodes[n->next[i]];
+         if (d < m->depth) {
+            m->depth = d;
+            if (!queued[n->next[i]]) {
+               queued[n->next[i]] = true;
+               work[work_len++] = n->next[i];
+            }
+         }
+      }
+   }
+   free(work);
+   free(queued);
+}
+
+// Writes c as a C expression of type cell.
+static void emit_cell(FILE *f, cell c) {
+   char buf[CELL_DIGITS];
+   if (c == CELL_MIN)
+      fputs("CELL_MIN", f);
+#if CELL_BITS > 64
+   else if (c <= LLONG_MIN || c > LLONG_MAX)
+      // There are no 128-bit literals.
+      fprintf(f, "((cell)%lld * ((cell)1 << 64) + (cell)%lluu)",
+              (long long)(c >> 64), (unsigned long long)c);
+#endif
+   else
+      fputs(cell_format(c, buf), f);
+}
+
+static void emit_node(FILE *f, size_t k) {
+   const Node *n = &nodes[k];
+   const size_t *next = n->next;
+
+   // The functions for the node's first, second, and third pops.
+   const char *pop[3];
+   for (size_t i = 0; i < 3; ++i)
+      pop[i] = i < n->depth ? "cc_pop_pushed" : "cc_pop";
+
+   fprintf(f, "n%zu: // ( %ld %ld ) ", k, (long)n->pos.x, (long)n->pos.y);
+   if (n->i > ' ' && n->i < 127 && n->i != '\\')
+      fprintf(f, "%c\n", (char)n->i);
+   else
+      fprintf(f, "%ld\n", (long)n->i);
+
+   switch (n->i) {
+   case '@':
+      fputs("   return 0;\n", f);
+      return;
+
+   case '_':
+   case '|':
+      fprintf(f, "   if (%s(cc))\n"
+                 "      goto n%zu;\n"
+                 "   goto n%zu;\n", pop[0], next[1], next[0]);
+      return;
+   case 'w':
+      fprintf(f, "   {\n"
+                 "      cell a = %s(cc), b = %s(cc);\n"
+                 "      if (a > b) goto n%zu;\n"
+                 "      if (a < b) goto n%zu;\n"
+                 "   }\n"
+                 "   goto n%zu;\n", pop[0], pop[1], next[1], next[2], next[0]);
+      return;
+
+   case '&':
+   case '~':
+      fprintf(f, "   {\n"
+                 "      cell c;\n"
+                 "      fflush(stdout);\n"
+                 "      if (!%s(&c)) goto n%zu;\n"
+                 "      cc_push(cc, c);\n"
+                 "   }\n"
+                 "   goto n%zu;\n",
+              n->i == '&' ? "read_number" : "read_char", next[1], next[0]);
+      return;
+
+   case '0': case '1': case '2': case '3': case '4':
+   case '5': case '6': case '7': case '8': case '9':
+      fprintf(f, "   cc_push(cc, %ld);\n", (long)(n->i - '0'));
+      break;
+   case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+      fprintf(f, "   cc_push(cc, %ld);\n", (long)(n->i - 'a' + 10));
+      break;
+   case '\'':
+      fputs("   cc_push(cc, ", f);
+      emit_cell(f, n->value);
+      fputs(");\n", f);
+      break;
+   case '"':
+      if (n->str_len)
+         fprintf(f, "   memcpy(cc_reserve(cc, %zu), str%zu, sizeof str%zu);\n",
+                 n->str_len, k, k);
+      break;
+
+   // The pops are in separate declarations so that they happen in order.
+   case '+': case '*': case '-': case '`':
+      fprintf(f, "   { cell a = %s(cc), b = %s(cc); cc_push(cc, b %s a); }\n",
+              pop[0], pop[1],
+              n->i == '+' ? "+" : n->i == '*' ? "*" : n->i == '-' ? "-" : ">");
+      break;
+   case '/':
+   case '%':
+      fprintf(f, "   {\n"
+                 "      cell a = %s(cc), b = %s(cc);\n"
+                 "      cc_push(cc, a ? b %c a : a);\n"
+                 "   }\n", pop[0], pop[1], (char)n->i);
+      break;
+   case '!': fprintf(f, "   cc_push(cc, !%s(cc));\n", pop[0]); break;
+
+   case ':':
+      fprintf(f, "   { cell a = %s(cc); cc_push(cc, a); cc_push(cc, a); }\n",
+              pop[0]);
+      break;
+   case '\\':
+      fprintf(f, "   {\n"
+                 "      cell a = %s(cc), b = %s(cc);\n"
+                 "      cc_push(cc, a);\n"
+                 "      cc_push(cc, b);\n"
+                 "   }\n", pop[0], pop[1]);
+      break;
+   case '$':
+      if (n->depth)
+         fputs("   cc_pop_pushed(cc);\n", f);
+      else
+         fputs("   cc_popN(cc, 1);\n", f);
+      break;
+   case 'n': fputs("   cc_clear(cc);\n", f); break;
+
+   case '.':
+      fprintf(f, "   {\n"
+                 "      char buf[CELL_DIGITS];\n"
+                 "      fputs(cell_format(%s(cc), buf), stdout);\n"
+                 "      putchar_unlocked(' ');\n"
+                 "   }\n", pop[0]);
+      break;
+   case ',':
+      fprintf(f, "   {\n"
+                 "      char c = (char)%s(cc);\n"
+                 "      putchar_unlocked(c);\n"
+                 "      if (c == '\\n')\n"
+                 "         fflush(stdout);\n"
+                 "   }\n", pop[0]);
+      break;
+
+   case 'g':
+      fprintf(f, "   {\n"
+                 "      cell y = %s(cc), x = %s(cc);\n"
+                 "      cc_push(cc, space_get(x, y));\n"
+                 "   }\n", pop[0], pop[1]);
+      break;
+   case 'y':
+      fprintf(f, "   switch (%s(cc)) {\n"
+                 "   case  9: cc_push(cc, ", pop[0]);
+      emit_cell(f, n->pos.x);
+      fputs("); break;\n"
+            "   case 10: cc_push(cc, ", f);
+      emit_cell(f, n->pos.y);
+      fputs("); break;\n"
+            "   }\n", f);
+      break;
+   }
+   fprintf(f, "   goto n%zu;\n", next[0]);
+}
+
+static void emit_cells(FILE *f, const cell *c, size_t n) {
+   for (size_t i = 0; i < n; ++i) {
+      fputs(i % 12 ? " " : "\n   ", f);
+      emit_cell(f, c[i]);
+      fputc(',', f);
+   }
+   fputs("\n};\n", f);
+}
+
+static bool emit(FILE *f, const char *path) {
+   fputs("// Generated by hali's ahead-of-time compiler. Build with:\n"
+         "//\n"
+         "//    cc -O2 -I<hali> -o prog ", f);
+   fprintf(f, "%s\n\n", path);
+   fprintf(f, "#define CELL_BITS %d\n", CELL_BITS);
+   fputs("#define _POSIX_C_SOURCE 200809L\n"
+         "#include <stdio.h>\n"
+         "#include <string.h>\n"
+         "\n"
+         "#include \"stack.c\"\n"
+         "#include \"input.h\"\n"
+         "\n"
+         "// For pops that the compiler found can't meet an empty stack.\n"
+         "// With NARROW_STACK, they may have been moved out of the array.\n"
+         "#ifdef NARROW_STACK\n"
+         "#define cc_pop_pushed cc_pop\n"
+         "#else\n"
+         "static inline cell cc_pop_pushed(CellContainer *cc) {\n"
+         "#ifdef MODE\n"
+         "   // ( isn't compiled, so it's never a Deque.\n"
+         "   Stack_cell *s = &cc->u.stack;\n"
+         "#else\n"
+         "   Stack_cell *s = cc;\n"
+         "#endif\n"
+         "   return s->array[--s->head];\n"
+         "}\n"
+         "#endif\n", f);
+
+   for (size_t k = 0; k < nodes_len; ++k) {
+      if (nodes[k].i != '"' || !nodes[k].str_len)
+         continue;
+      fprintf(f, "\nstatic const cell str%zu[] = {", k);
+      emit_cells(f, nodes[k].str, nodes[k].str_len);
+   }
+
+   if (uses_g) {
+      mushbounds2 b;
+      mushspace2_get_loose_bounds(space, &b);
+      size_t w = b.end.x - b.beg.x + 1, h = b.end.y - b.beg.y + 1;
+      cell *cells = malloc(w * h * sizeof *cells), *p = cells;
+      for (cell y = b.beg.y; y <= b.end.y; ++y)
+         for (cell x = b.beg.x; x <= b.end.x; ++x)
+            *p++ = mushspace2_get(space, MUSHCOORDS2(x, y));
+
+      fprintf(f, "\nstatic const cell space[] = {");
+      emit_cells(f, cells, w * h);
+      free(cells);
+      fputs("\nstatic cell space_get(cell x, cell y) {\n"
+            "   x -= ", f);
+      emit_cell(f, b.beg.x);
+      fputs(";\n"
+            "   y -= ", f);
+      emit_cell(f, b.beg.y);
+      fprintf(f, ";\n"
+                 "   if (x < 0 || x >= %zu || y < 0 || y >= %zu)\n"
+                 "      return ' ';\n"
+                 "   return space[y * %zu + x];\n"
+                 "}\n", w, h, w);
+   }
+
+   fputs("\nint main(void) {\n"
+         "   CellContainer cc_buf = cc_init(0), *cc = &cc_buf;\n"
+         "   goto n0;\n\n", f);
+   for (size_t k = 0; k < nodes_len; ++k)
+      emit_node(f, k);
+   fputs("}\n", f);
+   return !ferror(f);
+}
+
+static void cleanup(void) {
+   for (size_t k = 0; k < nodes_len; ++k)
+      free(nodes[k].str);
+   free(nodes);
+   free(index_tab);
+   nodes     = NULL;
+   index_tab = NULL;
+   nodes_len = nodes_cap = index_cap = 0;
+   mushcursor2_free(cursor);
+   free(cursor);
+}
+
+AotResult aot_compile(const char *arg0, mushspace2 *s, const char *path) {
+   space  = s;
+   cursor = mushcursor2_init(NULL, space, MUSHCOORDS2(0,0));
+   mushspace2_set_handler(space, handler, NULL);
+
+   if (setjmp(jmp)) {
+      mushcoords2 pos = mushcursor2_get_pos(cursor);
+      fprintf(stderr, "%s: can't compile ahead of time: "
+                      "cursor infloops at ( %ld %ld )\n",
+              arg0, (long)pos.x, (long)pos.y);
+      cleanup();
+      return AOT_UNSUPPORTED;
+   }
+
+   size_t bad = step(MUSHCOORDS2(0,0), MUSHCOORDS2(1,0), 0);
+   if (bad != SIZE_MAX)
+      bad = explore();
+   if (bad != SIZE_MAX || nodes_len == MAX_NODES) {
+      if (nodes_len == MAX_NODES)
+         fprintf(stderr, "%s: can't compile ahead of time: too many paths\n",
+                 arg0);
+      else {
+         const Node *n = &nodes[bad];
+         fprintf(stderr, "%s: can't compile ahead of time: "
+                         "'%c' at ( %ld %ld )\n",
+                 arg0, (char)n->i, (long)n->pos.x, (long)n->pos.y);
+      }
+      cleanup();
+      return AOT_UNSUPPORTED;
+   }
+
+   if (uses_g) {
+      mushbounds2 b;
+      mushspace2_get_loose_bounds(space, &b);
+      uint64_t w = (uint64_t)b.end.x - b.beg.x + 1,
+               h = (uint64_t)b.end.y - b.beg.y + 1;
+      if (w > MAX_G_AREA || h > MAX_G_AREA / w) {
+         fprintf(stderr, "%s: can't compile ahead of time: "
+                         "g on a Funge-space too large to embed\n", arg0);
+         cleanup();
+         return AOT_UNSUPPORTED;
+      }
+   }
+
+   find_depths();
+
+   FILE *f = fopen(path, "w");
+   if (!f) {
+      cleanup();
+      return AOT_ERROR;
+   }
+   bool ok = emit(f, path);
+   cleanup();
+   if (fclose(f) == EOF || !ok)
+      return AOT_ERROR;
+   return AOT_COMPILED;
+}
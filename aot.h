@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 18:31:40
+
+// Ahead-of-time compilation to C, enabled with -DAOT. Programs that can't
+// modify themselves or move in ways that depend on the values on the stack
+// have a control flow graph that can be found by following every path the
+// cursor can take through Funge-space, starting from the origin. Each node
+// of the graph is an instruction executed at a given position with a given
+// delta, and becomes a label in the generated C. Branches become gotos.
+//
+// The generated translation unit includes stack.c and input.h, so it needs
+// nothing but the directory containing them on the include path:
+//
+//    cc -O2 -I<hali> -o prog prog.c
+
+#ifndef AOT_H
+#define AOT_H
+
+#include <mush/space.h>
+
+typedef enum {
+   AOT_COMPILED,
+
+   // The program does something that can't be compiled: a message saying
+   // what and where has been printed.
+   AOT_UNSUPPORTED,
+
+   // Writing the output failed: errno is set.
+   AOT_ERROR,
+} AotResult;
+
+// Compiles the program in the given space into C at the given path. The
+// space must be as loaded and is left unmodified, but its error handler is
+// replaced.
+AotResult aot_compile(const char *arg0, mushspace2 *, const char *path);
+
+#endif
@@ -0,0 +1,366 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 13:27:40
+
+// Runs the interpreter over a corpus of Funge-98 programs and reports, for
+// each one, the wall time, instructions per second, peak RSS and page faults.
+// Optionally compares against a stored baseline and flags regressions.
+//
+// The interpreter must have been built with -DSTATS so that it reports the
+// number of instructions it executed. Build this runner with e.g.:
+//
+//    cc -std=gnu99 -O2 -o corpus_bench bench/corpus_bench.c
+//
+// and run it as:
+//
+//    ./corpus_bench [-n runs] [-b baseline] [-u] [-t tolerance]
+//                   [-s input_bytes] <interpreter> <corpus_dir>
+//
+// Each program is run the given number of times (default 5) and the fastest
+// run is the one reported. If a file with the same name as the program but
+// with the extension .in exists, its contents are repeated up to input_bytes
+// (default 8 MiB) and fed to the program's stdin; otherwise stdin is
+// /dev/null. The program's stdout is discarded.
+//
+// With -b, results are compared to the given baseline file: a wall time more
+// than tolerance percent (default 5) above the baseline, a peak RSS more than
+// that plus a megabyte of noise above it, or a different instruction count, is
+// flagged and makes the exit status 1. With
+// -u, the baseline file is instead (over)written with the current results.
+
+#define _DEFAULT_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+typedef struct {
+   char name[256];
+   double wall_ns;
+   uintmax_t instructions;
+   long maxrss_kb;
+   long minflt, majflt;
+} Result;
+
+typedef struct {
+   Result *ptr;
+   size_t len;
+} Results;
+
+static const char *arg0;
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_names(const void *a, const void *b) {
+   return strcmp(*(char *const*)a, *(char *const*)b);
+}
+
+// Writes the given data repeatedly into fd until total bytes have been
+// written or the reader goes away. Runs in a child process.
+static void feed(int fd, const char *data, size_t len, size_t total) {
+   signal(SIGPIPE, SIG_IGN);
+   for (size_t done = 0; done < total;) {
+      size_t n = len < total - done ? len : total - done;
+      ssize_t w = write(fd, data, n);
+      if (w <= 0)
+         break;
+      done += w;
+   }
+   _exit(0);
+}
+
+static char *read_file(const char *path, size_t *len) {
+   FILE *f = fopen(path, "rb");
+   if (!f)
+      return NULL;
+   char *buf = NULL;
+   size_t cap = 0;
+   *len = 0;
+   for (;;) {
+      if (*len == cap)
+         buf = realloc(buf, cap = cap ? 2*cap : 4096);
+      size_t n = fread(buf + *len, 1, cap - *len, f);
+      if (!n)
+         break;
+      *len += n;
+   }
+   fclose(f);
+   return buf;
+}
+
+// Runs the interpreter once over the given program, filling in everything in
+// the result except the name. Returns false on failure.
+static bool run_once(
+   const char *interp, const char *prog, const char *input, size_t input_len,
+   size_t input_bytes, Result *res)
+{
+   int errp[2], inp[2] = {-1, -1};
+   if (pipe(errp) == -1 || (input && pipe(inp) == -1)) {
+      perror("pipe");
+      return false;
+   }
+
+   pid_t feeder = -1;
+   if (input) {
+      feeder = fork();
+      if (feeder == 0) {
+         close(inp[0]);
+         close(errp[0]);
+         close(errp[1]);
+         feed(inp[1], input, input_len, input_bytes);
+      }
+   }
+
+   double t0 = now();
+   pid_t pid = fork();
+   if (pid == -1) {
+      perror("fork");
+      return false;
+   }
+   if (pid == 0) {
+      int in = input ? inp[0] : open("/dev/null", O_RDONLY);
+      int out = open("/dev/null", O_WRONLY);
+      dup2(in, 0);
+      dup2(out, 1);
+      dup2(errp[1], 2);
+      close(errp[0]);
+      if (input)
+         close(inp[1]);
+      execl(interp, interp, prog, (char*)NULL);
+      fprintf(stderr, "%s: exec %s: %s\n", arg0, interp, strerror(errno));
+      _exit(127);
+   }
+   close(errp[1]);
+   if (input) {
+      close(inp[0]);
+      close(inp[1]);
+   }
+
+   // Read stderr to the end before waiting so that the interpreter can't
+   // block on a full pipe. Only the start of it is kept: that's where the
+   // instruction count is, anything after it is e.g. a -DPROFILE report.
+   char errbuf[4096], discard[4096];
+   size_t errlen = 0;
+   for (ssize_t n;;) {
+      if (errlen < sizeof errbuf - 1)
+         n = read(errp[0], errbuf + errlen, sizeof errbuf - 1 - errlen);
+      else
+         n = read(errp[0], discard, sizeof discard);
+      if (n <= 0)
+         break;
+      if (errlen < sizeof errbuf - 1)
+         errlen += n;
+   }
+   errbuf[errlen] = 0;
+   close(errp[0]);
+
+   int status;
+   struct rusage ru;
+   if (wait4(pid, &status, 0, &ru) == -1) {
+      perror("wait4");
+      return false;
+   }
+   res->wall_ns = now() - t0;
+
+   if (feeder != -1) {
+      kill(feeder, SIGTERM);
+      waitpid(feeder, NULL, 0);
+   }
+
+   res->maxrss_kb = ru.ru_maxrss;
+   res->minflt    = ru.ru_minflt;
+   res->majflt    = ru.ru_majflt;
+
+   const char *p = strstr(errbuf, " instructions");
+   if (!p) {
+      fprintf(stderr, "%s: %s: no instruction count from %s "
+                      "(not built with -DSTATS?)\n%s",
+              arg0, prog, interp, errbuf);
+      return false;
+   }
+   while (p > errbuf && p[-1] >= '0' && p[-1] <= '9')
+      --p;
+   res->instructions = strtoumax(p, NULL, 10);
+
+   if (!WIFEXITED(status))
+      fprintf(stderr, "%s: %s: interpreter died abnormally\n", arg0, prog);
+   return true;
+}
+
+static bool load_baseline(const char *path, Results *base) {
+   FILE *f = fopen(path, "r");
+   if (!f)
+      return false;
+   char line[512];
+   while (fgets(line, sizeof line, f)) {
+      if (line[0] == '#')
+         continue;
+      Result r;
+      if (sscanf(line, "%255s %lf %ju %ld %ld %ld", r.name, &r.wall_ns,
+                 &r.instructions, &r.maxrss_kb, &r.minflt, &r.majflt) != 6)
+         continue;
+      base->ptr = realloc(base->ptr, (base->len + 1) * sizeof *base->ptr);
+      base->ptr[base->len++] = r;
+   }
+   fclose(f);
+   return true;
+}
+
+static bool save_baseline(const char *path, const Results *rs) {
+   FILE *f = fopen(path, "w");
+   if (!f)
+      return false;
+   fprintf(f, "# name wall_ns instructions maxrss_kb minflt majflt\n");
+   for (size_t i = 0; i < rs->len; ++i) {
+      const Result *r = &rs->ptr[i];
+      fprintf(f, "%s %.0f %ju %ld %ld %ld\n", r->name, r->wall_ns,
+              r->instructions, r->maxrss_kb, r->minflt, r->majflt);
+   }
+   return fclose(f) == 0;
+}
+
+static const Result *find(const Results *rs, const char *name) {
+   for (size_t i = 0; i < rs->len; ++i)
+      if (!strcmp(rs->ptr[i].name, name))
+         return &rs->ptr[i];
+   return NULL;
+}
+
+int main(int argc, char **argv) {
+   arg0 = argv[0];
+
+   unsigned runs = 5;
+   const char *baseline = NULL;
+   bool update = false;
+   double tolerance = 5;
+   size_t input_bytes = 8 << 20;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "n:b:ut:s:")) != -1) {
+      switch (opt) {
+      case 'n': runs        = strtoul(optarg, NULL, 10); break;
+      case 'b': baseline    = optarg;                    break;
+      case 'u': update      = true;                      break;
+      case 't': tolerance   = strtod(optarg, NULL);      break;
+      case 's': input_bytes = strtoul(optarg, NULL, 10); break;
+      default: goto usage;
+      }
+   }
+   if (argc - optind != 2 || !runs || (update && !baseline)) {
+usage:
+      fprintf(stderr, "Usage: %s [-n runs] [-b baseline] [-u] [-t tolerance] "
+                      "[-s input_bytes] <interpreter> <corpus_dir>\n", arg0);
+      return 3;
+   }
+   const char *interp = argv[optind], *dir = argv[optind + 1];
+
+   DIR *d = opendir(dir);
+   if (!d) {
+      fprintf(stderr, "%s: %s: %s\n", arg0, dir, strerror(errno));
+      return 2;
+   }
+   char **names = NULL;
+   size_t nnames = 0;
+   for (struct dirent *e; (e = readdir(d));) {
+      size_t len = strlen(e->d_name);
+      if (len > 4 && !strcmp(e->d_name + len - 4, ".b98")) {
+         names = realloc(names, (nnames + 1) * sizeof *names);
+         names[nnames++] = strdup(e->d_name);
+      }
+   }
+   closedir(d);
+   qsort(names, nnames, sizeof *names, cmp_names);
+
+   Results base = {NULL, 0}, cur = {NULL, 0};
+   if (baseline && !update && !load_baseline(baseline, &base)) {
+      fprintf(stderr, "%s: %s: %s\n", arg0, baseline, strerror(errno));
+      return 2;
+   }
+
+   printf("%-20s %10s %12s %10s %10s %8s\n",
+          "program", "wall ms", "Minsn/s", "maxrss KB", "minflt", "majflt");
+
+   bool regressed = false;
+   for (size_t i = 0; i < nnames; ++i) {
+      char path[4096], inpath[4096];
+      snprintf(path, sizeof path, "%s/%s", dir, names[i]);
+      snprintf(inpath, sizeof inpath, "%.*s.in",
+               (int)strlen(path) - 4, path);
+
+      size_t input_len = 0;
+      char *input = read_file(inpath, &input_len);
+      if (input && !input_len) {
+         free(input);
+         input = NULL;
+      }
+
+      Result best;
+      bool ok = true;
+      for (unsigned r = 0; r < runs && ok; ++r) {
+         Result res;
+         ok = run_once(interp, path, input, input_len, input_bytes, &res);
+         if (ok && (!r || res.wall_ns < best.wall_ns))
+            best = res;
+      }
+      free(input);
+      if (!ok) {
+         regressed = true;
+         continue;
+      }
+
+      snprintf(best.name, sizeof best.name, "%.*s",
+               (int)strlen(names[i]) - 4, names[i]);
+      cur.ptr = realloc(cur.ptr, (cur.len + 1) * sizeof *cur.ptr);
+      cur.ptr[cur.len++] = best;
+
+      printf("%-20s %10.2f %12.2f %10ld %10ld %8ld",
+             best.name, best.wall_ns / 1e6,
+             best.instructions / (best.wall_ns / 1e9) / 1e6,
+             best.maxrss_kb, best.minflt, best.majflt);
+
+      const Result *b = baseline && !update ? find(&base, best.name) : NULL;
+      if (b) {
+         double slack = 1 + tolerance / 100;
+         if (best.instructions != b->instructions) {
+            printf("  CHANGED: %ju instructions, was %ju",
+                   best.instructions, b->instructions);
+            regressed = true;
+         }
+         if (best.wall_ns > b->wall_ns * slack) {
+            printf("  SLOWER: %+.1f%% wall",
+                   (best.wall_ns / b->wall_ns - 1) * 100);
+            regressed = true;
+         }
+         if (best.maxrss_kb > b->maxrss_kb * slack + 1024) {
+            printf("  BIGGER: %+.1f%% maxrss",
+                   ((double)best.maxrss_kb / b->maxrss_kb - 1) * 100);
+            regressed = true;
+         }
+      }
+      putchar('\n');
+      fflush(stdout);
+   }
+
+   if (update && !save_baseline(baseline, &cur)) {
+      fprintf(stderr, "%s: %s: %s\n", arg0, baseline, strerror(errno));
+      return 2;
+   }
+   return regressed;
+}
@@ -0,0 +1,282 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 12:03:11
+
+// Microbenchmarks for the containers in stack.c: Stack_cell and Deque (both
+// through the cc_* API, exactly as main.c uses them) and Stack_stack.
+//
+// Build from the top-level directory with e.g.:
+//
+//    cc -std=gnu99 -O2 -o stack_bench bench/stack_bench.c
+//
+// (with -DNARROW_STACK to measure the Stack_cell that narrows its bottom
+// cells) and run as:
+//
+//    ./stack_bench [-m max_exponent] [-r min_ops] [filter]
+//
+// Every benchmark is run at sizes 10, 100, ..., 10^max_exponent (default 8)
+// and is repeated until at least min_ops (default 10^7) operations have been
+// done. Only benchmarks whose "container/op" name contains the filter string
+// are run. Reports nanoseconds per operation along with the number of
+// allocator calls (malloc, realloc, free) and bytes requested per repetition.
+//
+// stack.c is included directly so that the Deque internals are visible and
+// so that its allocations can be counted.
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t alloc_calls, alloc_bytes;
+
+static void *counting_malloc(size_t n) {
+   ++alloc_calls;
+   alloc_bytes += n;
+   return malloc(n);
+}
+static void *counting_realloc(void *p, size_t n) {
+   ++alloc_calls;
+   alloc_bytes += n;
+   return realloc(p, n);
+}
+static void counting_free(void *p) {
+   if (p)
+      ++alloc_calls;
+   free(p);
+}
+
+// The Deque is only compiled in with MODE, and we want to measure it.
+#ifndef MODE
+#define MODE
+#endif
+
+#define malloc  counting_malloc
+#define realloc counting_realloc
+#define free    counting_free
+#include "../stack.c"
+#undef malloc
+#undef realloc
+#undef free
+
+// Something the compiler can't see through, so that the results of the
+// benchmarked operations aren't optimized away.
+static volatile cell sink;
+
+static cell sum_acc;
+static void sum_f(cell *a, size_t n) {
+   for (size_t i = 0; i < n; ++i)
+      sum_acc += a[i];
+}
+static void sum_g(size_t n) { sum_acc += n; }
+static int sum_each(cell *c) {
+   sum_acc += *c;
+   return 1;
+}
+
+typedef struct {
+   bool isDeque;
+   int mode;
+} Kind;
+
+static CellContainer make(Kind k) {
+   CellContainer cc = cc_init(k.isDeque);
+   if (k.isDeque)
+      cc.u.deque.mode = k.mode;
+   return cc;
+}
+
+static void fill(CellContainer *cc, size_t n) {
+   for (size_t i = 0; i < n; ++i)
+      cc_push(cc, (cell)i);
+}
+
+// Each benchmark does one repetition of n operations on a container that
+// has been filled to size n beforehand if `filled` is set. The filling is not
+// part of the measured time. Returns the number of operations performed.
+typedef struct {
+   const char *name;
+   bool filled;
+   size_t (*run)(CellContainer*, size_t);
+} Op;
+
+static size_t op_push(CellContainer *cc, size_t n) {
+   fill(cc, n);
+   return n;
+}
+static size_t op_pop(CellContainer *cc, size_t n) {
+   cell s = 0;
+   for (size_t i = 0; i < n; ++i)
+      s += cc_pop(cc);
+   sink = s;
+   return n;
+}
+static size_t op_popN(CellContainer *cc, size_t n) {
+   // Chunks of 16, as in a program that drops a handful of cells at a time.
+   size_t ops = 0;
+   for (size_t i = 0; i < n; i += 16, ++ops)
+      cc_popN(cc, 16);
+   return ops;
+}
+static size_t op_reserve(CellContainer *cc, size_t n) {
+   // Blocks of 64, as when pushing many short strings.
+   size_t ops = 0;
+   for (size_t i = 0; i < n; i += 64, ++ops) {
+      cell *p = cc_reserve(cc, 64);
+      for (size_t j = 0; j < 64; ++j)
+         p[j] = (cell)j;
+   }
+   return ops;
+}
+static size_t op_mapFirstN(CellContainer *cc, size_t n) {
+   sum_acc = 0;
+   // Ask for more than there is, so that the underflow path is covered.
+   cc_mapFirstN(cc, n + n/2, sum_f, sum_g);
+   sink = sum_acc;
+   return n;
+}
+static size_t op_at(CellContainer *cc, size_t n) {
+   cell s = 0;
+   for (size_t i = 0; i < n; ++i)
+      s += cc_at(cc, i);
+   sink = s;
+   return n;
+}
+static size_t op_setAt(CellContainer *cc, size_t n) {
+   for (size_t i = 0; i < n; ++i)
+      cc_setAt(cc, i, (cell)(n - i));
+   return n;
+}
+static size_t op_foreach(CellContainer *cc, size_t n) {
+   sum_acc = 0;
+   cc_foreachTopToBottom(cc, sum_each);
+   sink = sum_acc;
+   return n;
+}
+
+static const Op ops[] = {
+   {"push",       false, op_push},
+   {"pop",        true,  op_pop},
+   {"popN",       true,  op_popN},
+   {"reserve",    false, op_reserve},
+   {"mapFirstN",  true,  op_mapFirstN},
+   {"at",         true,  op_at},
+   {"setAt",      true,  op_setAt},
+   {"foreach",    true,  op_foreach},
+};
+
+static const struct { const char *name; Kind kind; } kinds[] = {
+   {"stack",       {false, 0}},
+   {"deque",       {true,  0}},
+   {"deque-inv",   {true,  INVERT_MODE}},
+   {"deque-queue", {true,  QUEUE_MODE}},
+   {"deque-both",  {true,  INVERT_MODE | QUEUE_MODE}},
+};
+
+static double now(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(
+   const char *cont, const char *op, size_t n, double ns, size_t ops,
+   size_t reps, size_t calls, size_t bytes)
+{
+   printf("%-12s %-10s %10zu %10.2f ns/op %10.1f allocs/rep %12.0f B/rep\n",
+          cont, op, n, ns / ops, (double)calls / reps, (double)bytes / reps);
+   fflush(stdout);
+}
+
+static void bench_cc(const char *cont, Kind k, const Op *op, size_t n,
+                     size_t min_ops)
+{
+   double ns = 0;
+   size_t done = 0, reps = 0, calls = 0, bytes = 0;
+   while (done < min_ops) {
+      CellContainer cc = make(k);
+      if (op->filled)
+         fill(&cc, n);
+
+      size_t c0 = alloc_calls, b0 = alloc_bytes;
+      double t0 = now();
+      done += op->run(&cc, n);
+      ns += now() - t0;
+      calls += alloc_calls - c0;
+      bytes += alloc_bytes - b0;
+      ++reps;
+
+      cc_free(&cc);
+   }
+   report(cont, op->name, n, ns, done, reps, calls, bytes);
+}
+
+static void bench_stack_stack(const char *op, size_t n, size_t min_ops) {
+   static CellContainer dummy;
+
+   double ns = 0;
+   size_t done = 0, reps = 0, calls = 0, bytes = 0;
+   while (done < min_ops) {
+      Stack_stack ss = stack_stack_init(2);
+      size_t c0 = alloc_calls, b0 = alloc_bytes;
+      double t0 = now();
+      if (!strcmp(op, "push"))
+         for (size_t i = 0; i < n; ++i)
+            stack_stack_push(&ss, &dummy);
+      else {
+         for (size_t i = 0; i < n; ++i) {
+            stack_stack_push(&ss, &dummy);
+            sink = (cell)(intptr_t)stack_stack_pop(&ss);
+         }
+      }
+      ns += now() - t0;
+      calls += alloc_calls - c0;
+      bytes += alloc_bytes - b0;
+      done += n;
+      ++reps;
+      stack_stack_free(&ss);
+   }
+   report("stackstack", op, n, ns, done, reps, calls, bytes);
+}
+
+static bool selected(const char *filter, const char *cont, const char *op) {
+   if (!filter)
+      return true;
+   char name[64];
+   snprintf(name, sizeof name, "%s/%s", cont, op);
+   return strstr(name, filter) != NULL;
+}
+
+int main(int argc, char **argv) {
+   int max_exp = 8;
+   size_t min_ops = 10000000;
+
+   int opt;
+   while ((opt = getopt(argc, argv, "m:r:")) != -1) {
+      switch (opt) {
+      case 'm': max_exp = atoi(optarg); break;
+      case 'r': min_ops = strtoul(optarg, NULL, 10); break;
+      default:
+         fprintf(stderr, "Usage: %s [-m max_exponent] [-r min_ops] [filter]\n",
+                 argv[0]);
+         return 3;
+      }
+   }
+   const char *filter = optind < argc ? argv[optind] : NULL;
+
+   for (size_t n = 10, e = 1; (int)e <= max_exp; n *= 10, ++e) {
+      for (size_t k = 0; k < sizeof kinds / sizeof *kinds; ++k)
+         for (size_t o = 0; o < sizeof ops / sizeof *ops; ++o)
+            if (selected(filter, kinds[k].name, ops[o].name))
+               bench_cc(kinds[k].name, kinds[k].kind, &ops[o], n, min_ops);
+
+      if (selected(filter, "stackstack", "push"))
+         bench_stack_stack("push", n, min_ops);
+      if (selected(filter, "stackstack", "pushpop"))
+         bench_stack_stack("pushpop", n, min_ops);
+   }
+}
@@ -0,0 +1,56 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 20:48:03
+
+// The cell type, whose width is chosen at build time with -DCELL_BITS=32, 64
+// (the default) or 128. Everything is built for the one width, stacks and
+// Funge-space alike, so mushspace must be built with a mushcell of the same
+// size. Shared with the C generated by the ahead-of-time compiler.
+
+#ifndef CELL_H
+#define CELL_H
+
+#include <limits.h>
+#include <stdint.h>
+
+#ifndef CELL_BITS
+#define CELL_BITS 64
+#endif
+
+#if CELL_BITS == 32
+typedef int32_t cell;
+typedef uint32_t ucell;
+#define CELL_MIN INT32_MIN
+#define CELL_MAX INT32_MAX
+#elif CELL_BITS == 64
+typedef long cell;
+typedef unsigned long ucell;
+#define CELL_MIN LONG_MIN
+#define CELL_MAX LONG_MAX
+#elif CELL_BITS == 128
+typedef __int128 cell;
+typedef unsigned __int128 ucell;
+#define CELL_MAX ((cell)(~(ucell)0 >> 1))
+#define CELL_MIN (-CELL_MAX - 1)
+#else
+#error "CELL_BITS must be 32, 64 or 128"
+#endif
+
+// Enough for any cell in decimal, with a sign and a terminating null.
+#define CELL_DIGITS (CELL_BITS * 3 / 10 + 3)
+
+// Writes c in decimal to the end of buf, returning where it starts. printf()
+// can't do 128-bit cells, and this is faster for the others anyway.
+static inline char *cell_format(cell c, char buf[static CELL_DIGITS]) {
+   char *p = buf + CELL_DIGITS - 1;
+   *p = 0;
+   ucell u = c < 0 ? -(ucell)c : (ucell)c;
+   do
+      *--p = (char)('0' + u % 10);
+   while (u /= 10);
+   if (c < 0)
+      *--p = '-';
+   return p;
+}
+
+#endif
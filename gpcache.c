@@ -0,0 +1,17 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 17:48:12
+
+#include "gpcache.h"
+
+void gp_cache_invalidate(GpCache *cache, mushcoords2 pos) {
+   mushcoords2 tag;
+   GpCacheLine *line = gp_cache_line(cache, pos, &tag);
+   if (line->tag.x == tag.x && line->tag.y == tag.y)
+      line->valid &= ~(1u << (pos.x & (GP_CACHE_LINE - 1)));
+}
+
+void gp_cache_clear(GpCache *cache) {
+   for (size_t i = 0; i < GP_CACHE_LINES; ++i)
+      cache->lines[i].valid = 0;
+}
@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 17:48:12
+
+// A cache of Funge-space cells for g and p, enabled with -DGP_CACHE. Programs
+// that use Funge-space as random-access memory tend to hit the same few rows
+// over and over, and finding the right box within mushspace for each access
+// costs more than a hash and a load.
+//
+// The cache is direct-mapped, with lines of GP_CACHE_LINE horizontally
+// adjacent cells. p writes through it, and anything else that writes to
+// Funge-space must invalidate what it wrote. Each IP should have a cache of
+// its own, since they tend to work on different data.
+
+#ifndef GPCACHE_H
+#define GPCACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+enum { GP_CACHE_LINE = 8, GP_CACHE_LINES = 256 };
+
+typedef struct {
+   // The position of the first cell in the line. Meaningless unless some
+   // cell is valid.
+   mushcoords2 tag;
+   uint8_t valid;
+   cell cells[GP_CACHE_LINE];
+} GpCacheLine;
+
+typedef struct {
+   GpCacheLine lines[GP_CACHE_LINES];
+} GpCache;
+
+static inline GpCacheLine *gp_cache_line(
+   GpCache *cache, mushcoords2 pos, mushcoords2 *tag)
+{
+   tag->x = pos.x & ~(cell)(GP_CACHE_LINE - 1);
+   tag->y = pos.y;
+   uint64_t h = (uint64_t)tag->x * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)tag->y * 0xc2b2ae3d27d4eb4fu;
+   return &cache->lines[(h >> 32) % GP_CACHE_LINES];
+}
+
+static inline bool gp_cache_get(GpCache *cache, mushcoords2 pos, cell *c) {
+   mushcoords2 tag;
+   const GpCacheLine *line = gp_cache_line(cache, pos, &tag);
+   const unsigned i = pos.x & (GP_CACHE_LINE - 1);
+   if (!(line->valid >> i & 1) || line->tag.x != tag.x || line->tag.y != tag.y)
+      return false;
+   *c = line->cells[i];
+   return true;
+}
+
+// Records the value of a cell, evicting whatever shared its line.
+static inline void gp_cache_set(GpCache *cache, mushcoords2 pos, cell c) {
+   mushcoords2 tag;
+   GpCacheLine *line = gp_cache_line(cache, pos, &tag);
+   const unsigned i = pos.x & (GP_CACHE_LINE - 1);
+   if (line->tag.x != tag.x || line->tag.y != tag.y) {
+      line->tag   = tag;
+      line->valid = 0;
+   }
+   line->cells[i] = c;
+   line->valid   |= 1u << i;
+}
+
+void gp_cache_invalidate(GpCache *, mushcoords2);
+void gp_cache_clear(GpCache *);
+
+#endif
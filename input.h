@@ -0,0 +1,61 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 18:31:40
+
+// Reading numbers and characters for & and ~. Shared between the interpreter
+// and the C generated by the ahead-of-time compiler, which includes this
+// file, so it holds definitions.
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "stack.h"
+
+// Both return false on EOF.
+static inline bool read_number(cell *n) {
+   int i;
+   unsigned char c;
+   do {
+      if ((i = getchar_unlocked()) == EOF)
+         return false;
+      c = i;
+   } while (c < '0' || c > '9');
+   ungetc(c, stdin);
+
+   // Stops before the digit that would overflow, as strtol() would have.
+   *n = 0;
+   for (unsigned j = 0; j < CELL_DIGITS - 2; ++j) {
+      if ((i = getchar_unlocked()) == EOF)
+         break;
+
+      c = i;
+      if (c < '0' || c > '9')
+         break;
+
+      const int d = c - '0';
+      if (*n > (CELL_MAX - d) / 10)
+         break;
+      *n = *n * 10 + d;
+   }
+   if (i != EOF)
+      ungetc(c, stdin);
+   return true;
+}
+static inline bool read_char(cell *n) {
+   int i;
+   unsigned char c;
+   if ((i = getchar_unlocked()) == EOF)
+      return false;
+   if ((c = i) == '\r') {
+      if ((i = getchar_unlocked()) != '\n')
+         ungetc(i, stdin);
+      c = '\n';
+   }
+   *n = c;
+   return true;
+}
+
+#endif
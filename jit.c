@@ -0,0 +1,1025 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 19:02:17
+
+#define _DEFAULT_SOURCE
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+
+#include "jit.h"
+
+#ifndef __x86_64__
+#error "The JIT only generates x86-64 code."
+#endif
+#ifdef NARROW_STACK
+#error "The JIT works on the array of a Stack_cell, so needs all of it there."
+#endif
+
+_Static_assert(sizeof(uint_fast32_t) == 8 && sizeof(uintmax_t) == 8
+            && sizeof(cell) == 8,
+               "the generated code accesses the counters and cells as qwords");
+
+// HOT is how many times a head must be reached before recording from it.
+// After recording fails or the trace is invalidated, counting starts over
+// from -BACKOFF, so that self-modifying code doesn't keep being recompiled.
+enum {
+   HOT = 256, BACKOFF = 1 << 14,
+   MAX_STEPS = 1024, MAX_TRACES = 256,
+   HEADS = 1024, LINE_BITS = 1024,
+};
+
+typedef struct {
+   mushcoords2 after, delta;
+} Exit;
+
+// The cells from..to of a row or column.
+typedef struct {
+   bool row;
+   cell line, from, to;
+} Segment;
+
+struct Head;
+
+typedef struct Trace {
+   int (*code)(Stack_cell *, CellContainer *);
+   void *mem;
+   size_t mem_len, len;
+   Exit *exits;
+
+   // The cells read.
+   Segment *segs;
+   size_t nsegs;
+
+   // Whether the cursor wrapped around, so that where it went depends on the
+   // bounds of Funge-space.
+   bool pure, dead, wraps;
+   struct Head *head;
+   struct Trace *next;
+} Trace;
+
+typedef struct Head {
+   mushcoords2 pos, delta;
+   int32_t count;
+   Trace *trace;
+} Head;
+
+static JitHooks hooks;
+
+static Head heads[HEADS];
+
+// Traces can be invalidated while running, so they're only freed once back
+// in jit_enter().
+static Trace *live = NULL, *dead = NULL, *running = NULL;
+static size_t nlive = 0;
+
+// The bounds the live traces that wrap were compiled for, and how many of
+// them there are. A write outside may grow the bounds, so it kills them.
+static mushbounds2 wrap_bounds;
+static size_t nwrapping = 0;
+
+// Hashed sets of the rows and columns of the live traces, so that most writes
+// can be dismissed without looking at the traces themselves.
+static uint64_t row_bits[LINE_BITS / 64], col_bits[LINE_BITS / 64];
+
+bool jit_recording = false;
+static Head *rec_head;
+static JitStep rec_steps[MAX_STEPS];
+static size_t rec_len;
+static mushbounds2 rec_bounds;
+
+static bool eq(mushcoords2 a, mushcoords2 b) {
+   return a.x == b.x && a.y == b.y;
+}
+
+static size_t hash(mushcoords2 pos, mushcoords2 delta) {
+   uint64_t h = (uint64_t)pos.x   * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)pos.y   * 0xc2b2ae3d27d4eb4fu
+              ^ (uint64_t)delta.x * 0x165667b19e3779f9u
+              ^ (uint64_t)delta.y * 0x27d4eb2f165667c5u;
+   return h ^ h >> 29;
+}
+
+static size_t line_bit(cell c) {
+   return (uint64_t)c * 0x9e3779b97f4a7c15u >> 54;
+}
+static bool line_marked(const uint64_t *bits, cell c) {
+   const size_t i = line_bit(c);
+   return bits[i / 64] >> (i % 64) & 1;
+}
+static void line_mark(uint64_t *bits, cell c) {
+   const size_t i = line_bit(c);
+   bits[i / 64] |= 1ull << (i % 64);
+}
+
+static bool outside(const mushbounds2 *b, mushcoords2 pos) {
+   return pos.x < b->beg.x || pos.x > b->end.x
+       || pos.y < b->beg.y || pos.y > b->end.y;
+}
+
+// Whether # or ' took the cursor across the edge of Funge-space.
+static bool step_wrapped(const JitStep *s) {
+   if (s->string || (s->c != '#' && s->c != '\''))
+      return false;
+   return s->after.x != (cell)((ucell)s->pos.x + (ucell)s->delta.x)
+       || s->after.y != (cell)((ucell)s->pos.y + (ucell)s->delta.y);
+}
+
+// The cells read by a step and while looking for the next one, at next if
+// known. Unless the cursor wrapped around, that's just the cells in between.
+static Segment segment(const JitStep *s, const mushcoords2 *next) {
+   const bool row = s->next.y == 0;
+   Segment seg = {row, row ? s->pos.y : s->pos.x, MUSHCELL_MIN, MUSHCELL_MAX};
+   if (!next || step_wrapped(s))
+      return seg;
+
+   const cell d = row ? s->next.x : s->next.y,
+              p = row ? s->pos.x  : s->pos.y,
+              a = row ? s->after.x : s->after.y,
+              b = row ? next->x   : next->y;
+   if ((d > 0 && b > a) || (d < 0 && b < a)) {
+      seg.from = p < a ? p : a;
+      seg.to   = p < a ? a : p;
+      if (b < seg.from) seg.from = b;
+      if (b > seg.to)   seg.to   = b;
+   }
+   return seg;
+}
+
+static bool whole_line(const Segment *seg) {
+   return seg->from == MUSHCELL_MIN && seg->to == MUSHCELL_MAX;
+}
+
+static bool in_segment(const Segment *seg, mushcoords2 pos) {
+   const cell line = seg->row ? pos.y : pos.x,
+              at   = seg->row ? pos.x : pos.y;
+   return line == seg->line && at >= seg->from && at <= seg->to;
+}
+
+static bool on_trace(const Trace *t, mushcoords2 pos) {
+   for (size_t i = 0; i < t->nsegs; ++i)
+      if (in_segment(&t->segs[i], pos))
+         return true;
+   return false;
+}
+
+static void remark_lines(void) {
+   memset(row_bits, 0, sizeof row_bits);
+   memset(col_bits, 0, sizeof col_bits);
+   for (const Trace *t = live; t; t = t->next)
+      for (size_t i = 0; i < t->nsegs; ++i)
+         line_mark(t->segs[i].row ? row_bits : col_bits, t->segs[i].line);
+}
+
+static void back_off(Head *h) { h->count = -BACKOFF; }
+
+static void stop_recording(void) {
+   jit_recording = false;
+   back_off(rec_head);
+}
+
+static void invalidate(Trace *t) {
+   t->dead = true;
+   t->head->trace = NULL;
+   back_off(t->head);
+   t->next = dead;
+   dead = t;
+   --nlive;
+   nwrapping -= t->wraps;
+}
+
+static void free_dead(void) {
+   while (dead) {
+      Trace *t = dead;
+      dead = t->next;
+      munmap(t->mem, t->mem_len);
+      free(t->exits);
+      free(t->segs);
+      free(t);
+   }
+}
+
+void jit_init(const JitHooks *h) { hooks = *h; }
+
+void jit_free(void) {
+   jit_wrote_all();
+   free_dead();
+}
+
+void jit_wrote(mushcoords2 pos) {
+   // Whether the last step recorded wraps isn't known yet, so any write that
+   // might grow the bounds stops the recording.
+   if (jit_recording && outside(&rec_bounds, pos))
+      stop_recording();
+   if (jit_recording) {
+      for (size_t i = 0; i < rec_len; ++i) {
+         const Segment seg = segment(
+            &rec_steps[i], i + 1 < rec_len ? &rec_steps[i + 1].pos : NULL);
+         if (in_segment(&seg, pos)) {
+            stop_recording();
+            break;
+         }
+      }
+   }
+   const bool grows = nwrapping && outside(&wrap_bounds, pos);
+   if (!grows
+    && !line_marked(row_bits, pos.y) && !line_marked(col_bits, pos.x))
+      return;
+
+   bool killed = false;
+   for (Trace **p = &live; *p;) {
+      Trace *t = *p;
+      if ((grows && t->wraps) || on_trace(t, pos)) {
+         *p = t->next;
+         invalidate(t);
+         killed = true;
+      } else
+         p = &t->next;
+   }
+   if (killed)
+      remark_lines();
+}
+
+void jit_wrote_all(void) {
+   if (jit_recording)
+      stop_recording();
+   while (live) {
+      Trace *t = live;
+      live = t->next;
+      invalidate(t);
+   }
+   remark_lines();
+}
+
+//////////////////////////////////////////// Code generation
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+
+// Condition codes for jcc; JMP for an unconditional jump.
+enum { CC_B = 0x2, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6,
+       CC_L = 0xc, CC_G = 0xf, JMP = -1 };
+
+// While the generated code runs:
+//
+//    rbx is the Stack_cell and r15 the CellContainer it's in,
+//    r12 is its array, r13 its head, and r14 its capacity,
+//    rax holds the top of the stack if cached is true, below any consts.
+static uint8_t *buf;
+static size_t buf_len, buf_cap;
+
+static size_t *labels, labels_len, labels_cap;
+static struct { size_t at, label; } *fixups;
+static size_t fixups_len, fixups_cap;
+
+static struct { Exit exit; size_t label, refund; } *exits;
+static size_t exits_len, exits_cap;
+
+static bool cached;
+
+// Cells pushed by constant-pushing steps that haven't been materialized yet,
+// topmost last. Arithmetic on them is done while compiling, and branches on
+// them need no guard: the trace is thrown away if the cells that pushed them
+// are written to.
+#define MAX_CONSTS 32
+static cell consts[MAX_CONSTS];
+static size_t nconsts;
+
+// Each pass of the loop is generated twice: once with every pop from memory
+// checking for an empty stack, and once for when the stack is deep enough at
+// the start of the pass that the checks can be skipped. In the latter,
+// nonempty is how many of the current step's pops are known to find a cell,
+// any further ones being known to find the stack empty.
+static bool checked;
+static size_t nonempty;
+
+static void *grow_array(void *p, size_t *cap, size_t len, size_t size) {
+   if (len < *cap)
+      return p;
+   *cap = *cap ? 2 * *cap : 64;
+   return realloc(p, *cap * size);
+}
+
+static void emit(size_t n, ...) {
+   va_list args;
+   va_start(args, n);
+   while (n--) {
+      buf = grow_array(buf, &buf_cap, buf_len, 1);
+      buf[buf_len++] = (uint8_t)va_arg(args, int);
+   }
+   va_end(args);
+}
+static void imm32(uint32_t v) {
+   emit(4, v & 0xff, v >> 8 & 0xff, v >> 16 & 0xff, v >> 24);
+}
+static void imm64(uint64_t v) {
+   imm32((uint32_t)v);
+   imm32((uint32_t)(v >> 32));
+}
+
+static int rex(int r, int b) { return 0x48 | (r >> 3) << 2 | b >> 3; }
+static int modrm(int r, int b) { return 0xc0 | (r & 7) << 3 | (b & 7); }
+
+static void mov_rr(int dst, int src) {
+   emit(3, rex(src, dst), 0x89, modrm(src, dst));
+}
+static void mov_ri(int r, cell v) {
+   if (v == (int32_t)v) {
+      emit(3, rex(0, r), 0xc7, modrm(0, r));
+      imm32((uint32_t)v);
+   } else {
+      emit(2, rex(0, r), 0xb8 | (r & 7));
+      imm64((uint64_t)v);
+   }
+}
+static void xor32(int r) { emit(2, 0x31, modrm(r, r)); }
+static void test_rr(int r) { emit(3, rex(r, r), 0x85, modrm(r, r)); }
+
+// r <-> [rbx + disp]
+static void load_field(int r, size_t disp) {
+   emit(4, rex(r, RBX), 0x8b, 0x40 | (r & 7) << 3 | RBX, (int)disp);
+}
+static void store_field(size_t disp, int r) {
+   emit(4, rex(r, RBX), 0x89, 0x40 | (r & 7) << 3 | RBX, (int)disp);
+}
+
+// r <-> [r12 + r13*8]
+static void load_slot(int r) {
+   emit(4, rex(r, R12) | 2, 0x8b, 0x04 | (r & 7) << 3, 0xec);
+}
+static void store_slot(int r) {
+   emit(4, rex(r, R12) | 2, 0x89, 0x04 | (r & 7) << 3, 0xec);
+}
+
+static void call(uintptr_t fn) {
+   emit(2, 0x48, 0xb8);
+   imm64(fn);
+   emit(2, 0xff, 0xd0);
+}
+
+static size_t label(void) {
+   labels = grow_array(labels, &labels_cap, labels_len, sizeof *labels);
+   labels[labels_len] = SIZE_MAX;
+   return labels_len++;
+}
+static void bind(size_t l) { labels[l] = buf_len; }
+
+static void jump(int cond, size_t l) {
+   if (cond == JMP)
+      emit(1, 0xe9);
+   else
+      emit(2, 0x0f, 0x80 | cond);
+   fixups = grow_array(fixups, &fixups_cap, fixups_len, sizeof *fixups);
+   fixups[fixups_len].at    = buf_len;
+   fixups[fixups_len].label = l;
+   ++fixups_len;
+   imm32(0);
+}
+
+// Charges n instructions to the budget, or refunds -n.
+static void charge(int32_t n) {
+   emit(2, 0x48, 0xba);
+   imm64((uintptr_t)hooks.budget_slice);
+   emit(3, 0x48, 0x81, 0x2a); // sub qword [rdx], n
+   imm32((uint32_t)n);
+   if (hooks.instructions) {
+      emit(2, 0x48, 0xba);
+      imm64((uintptr_t)hooks.instructions);
+      emit(3, 0x48, 0x81, 0x02); // add qword [rdx], n
+      imm32((uint32_t)n);
+   }
+}
+
+// Returns a label to jump to in order to leave the trace after a step that
+// left the cursor at after with the given delta, refunding the instructions
+// of the pass that weren't executed.
+static size_t exit_to(mushcoords2 after, mushcoords2 delta, size_t refund) {
+   exits = grow_array(exits, &exits_cap, exits_len, sizeof *exits);
+   exits[exits_len].exit   = (Exit){after, delta};
+   exits[exits_len].label  = label();
+   exits[exits_len].refund = refund;
+   return exits[exits_len++].label;
+}
+
+static void grow_stack(CellContainer *cc) {
+   cc_push(cc, 0);
+#ifdef MODE
+   --cc->u.stack.head;
+#else
+   --cc->head;
+#endif
+}
+
+static bool put(cell x, cell y, cell v) {
+   hooks.put(x, y, v);
+   return running->dead;
+}
+
+// Pops into r, which must be below R8.
+static void pop(int r) {
+   if (nconsts) {
+      nonempty -= !checked;
+      mov_ri(r, consts[--nconsts]);
+      return;
+   }
+   if (cached) {
+      cached = false;
+      nonempty -= !checked;
+      if (r != RAX)
+         mov_rr(r, RAX);
+      return;
+   }
+   if (!checked) {
+      if (nonempty) {
+         --nonempty;
+         emit(3, 0x49, 0xff, 0xcd); // dec r13
+         load_slot(r);
+      } else
+         xor32(r);
+      return;
+   }
+   const size_t empty = label(), done = label();
+   emit(3, 0x4d, 0x85, 0xed); // test r13, r13
+   jump(CC_E, empty);
+   emit(3, 0x49, 0xff, 0xcd); // dec r13
+   load_slot(r);
+   jump(JMP, done);
+   bind(empty);
+   xor32(r);
+   bind(done);
+}
+
+// Pushes r, which must be RAX or RCX, onto the stack in memory. Preserves
+// both.
+static void push(int r) {
+   const size_t room = label();
+   emit(3, 0x4d, 0x39, 0xf5); // cmp r13, r14
+   jump(CC_B, room);
+   store_field(offsetof(Stack_cell, head), R13);
+   emit(2, 0x50, 0x51); // push rax; push rcx
+   mov_rr(RDI, R15);
+   call((uintptr_t)grow_stack);
+   emit(2, 0x59, 0x58); // pop rcx; pop rax
+   load_field(R12, offsetof(Stack_cell, array));
+   load_field(R14, offsetof(Stack_cell, capacity));
+   bind(room);
+   store_slot(r);
+   emit(3, 0x49, 0xff, 0xc5); // inc r13
+}
+
+// Materializes all but the top n consts, so that popping n cells leaves
+// nothing in rax or consts.
+static void settle(size_t n) {
+   if (nconsts < n)
+      return;
+   if (cached) {
+      cached = false;
+      push(RAX);
+   }
+   const size_t spill = nconsts - n;
+   for (size_t i = 0; i < spill; ++i) {
+      mov_ri(RAX, consts[i]);
+      push(RAX);
+   }
+   memmove(consts, consts + spill, n * sizeof *consts);
+   nconsts = n;
+}
+
+static void flush(void) {
+   settle(0);
+}
+
+static void push_const(cell v) {
+   if (nconsts == MAX_CONSTS)
+      settle(MAX_CONSTS / 2);
+   consts[nconsts++] = v;
+}
+
+static cell pop_const(void) {
+   nonempty -= !checked;
+   return consts[--nconsts];
+}
+
+// Executes the step while compiling, if it only depends on consts. Returns
+// whether it did so.
+static bool fold(const JitStep *s) {
+   const cell c = s->c;
+   switch (c) {
+   case '+': case '-': case '*': case '/': case '%': case '`': case '\\':
+   case 'w': {
+      if (nconsts < 2)
+         return false;
+      const cell a = consts[nconsts - 1], b = consts[nconsts - 2];
+      if (c == 'w') {
+         const mushcoords2 d = s->delta;
+         const mushcoords2 to = b > a ? MUSHCOORDS2(-d.y,  d.x)
+                              : b < a ? MUSHCOORDS2( d.y, -d.x)
+                              : d;
+         if (!eq(to, s->next))
+            return false;
+      }
+      pop_const();
+      pop_const();
+
+      // As in main.c, but wrapping instead of overflowing, and with division
+      // by -1 as negation like in the generated code.
+      const uint64_t ua = (uint64_t)a, ub = (uint64_t)b;
+      switch (c) {
+      case '+': push_const((cell)(ub + ua)); break;
+      case '-': push_const((cell)(ub - ua)); break;
+      case '*': push_const((cell)(ub * ua)); break;
+      case '/': push_const(a == -1 ? (cell)-ub : a ? b / a : 0); break;
+      case '%': push_const(a == -1 || !a ? 0 : b % a); break;
+      case '`': push_const(b > a); break;
+      case '\\':
+         push_const(a);
+         push_const(b);
+         break;
+      }
+      return true;
+   }
+   case '!':
+      if (!nconsts)
+         return false;
+      push_const(!pop_const());
+      return true;
+   case ':':
+      if (!nconsts)
+         return false;
+      push_const(consts[nconsts - 1]);
+      return true;
+   case '$':
+      if (!nconsts)
+         return false;
+      pop_const();
+      return true;
+   case '_': case '|': {
+      if (!nconsts)
+         return false;
+      const mushcoords2
+         zero = c == '_' ? MUSHCOORDS2(1,0) : MUSHCOORDS2(0,1),
+         to   = consts[nconsts - 1] ? MUSHCOORDS2(-zero.x, -zero.y) : zero;
+      if (!eq(to, s->next))
+         return false;
+      pop_const();
+      return true;
+   }
+   default:
+      return false;
+   }
+}
+
+static const char supported_instructions[] =
+   "0123456789abcdef+-*/%!`:\\$n_|w><^v[]rz#\"'gp.,";
+
+static bool supported(const JitStep *s) {
+   return s->string
+       || (s->c > 0 && s->c < 128 && strchr(supported_instructions, (int)s->c));
+}
+
+// The number of cells a step pops and pushes. n is left for the caller.
+static void stack_effect(const JitStep *s, size_t *pops, size_t *pushes) {
+   *pops = *pushes = 0;
+   if (s->string) {
+      *pushes = s->c != '"';
+      return;
+   }
+   switch (s->c) {
+   case '0': case '1': case '2': case '3': case '4':
+   case '5': case '6': case '7': case '8': case '9':
+   case 'a': case 'b': case 'c': case 'd': case 'e': case 'f': case '\'':
+      *pushes = 1;
+      break;
+   case '+': case '-': case '*': case '/': case '%': case '`': case 'g':
+      *pops = 2; *pushes = 1;
+      break;
+   case '\\': *pops = 2; *pushes = 2; break;
+   case ':':  *pops = 1; *pushes = 2; break;
+   case '!':  *pops = 1; *pushes = 1; break;
+   case '$': case '_': case '|': case '.': case ',':
+      *pops = 1;
+      break;
+   case 'w': *pops = 2; break;
+   case 'p': *pops = 3; break;
+   }
+}
+
+// Generates the code for a step, refund being the number of steps after it
+// in the pass. Returns whether the step is pure in the sense of main.c.
+static bool gen(const JitStep *s, size_t refund) {
+   if (s->string) {
+      if (s->c != '"')
+         push_const(s->c);
+      return false;
+   }
+
+   const cell c = s->c;
+   if (fold(s))
+      return false;
+
+   size_t pops, pushes;
+   stack_effect(s, &pops, &pushes);
+   if (pops)
+      settle(pops);
+
+   switch (c) {
+   case '0': case '1': case '2': case '3': case '4':
+   case '5': case '6': case '7': case '8': case '9':
+      push_const(c - '0');
+      break;
+   case 'a': case 'b': case 'c': case 'd': case 'e': case 'f':
+      push_const(c - 'a' + 10);
+      break;
+   case '\'':
+      push_const(s->value);
+      break;
+
+   case '+': case '-': case '*':
+      pop(RCX);
+      pop(RAX);
+      if (c == '+')
+         emit(3, 0x48, 0x01, 0xc8); // add rax, rcx
+      else if (c == '-')
+         emit(3, 0x48, 0x29, 0xc8); // sub rax, rcx
+      else
+         emit(4, 0x48, 0x0f, 0xaf, 0xc1); // imul rax, rcx
+      cached = true;
+      break;
+
+   case '/': case '%': {
+      // Division by zero gives zero, and by -1 is negation so that the most
+      // negative number doesn't trap.
+      const size_t zero = label(), minus_one = label(), done = label();
+      pop(RCX);
+      pop(RAX);
+      test_rr(RCX);
+      jump(CC_E, zero);
+      emit(4, 0x48, 0x83, 0xf9, 0xff); // cmp rcx, -1
+      jump(CC_E, minus_one);
+      emit(5, 0x48, 0x99, 0x48, 0xf7, 0xf9); // cqo; idiv rcx
+      if (c == '%')
+         mov_rr(RAX, RDX);
+      jump(JMP, done);
+      bind(minus_one);
+      if (c == '/') {
+         emit(3, 0x48, 0xf7, 0xd8); // neg rax
+         jump(JMP, done);
+      }
+      bind(zero);
+      xor32(RAX);
+      bind(done);
+      cached = true;
+      break;
+   }
+
+   case '!':
+      pop(RAX);
+      test_rr(RAX);
+      emit(6, 0x0f, 0x94, 0xc0, 0x0f, 0xb6, 0xc0); // sete al; movzx eax, al
+      cached = true;
+      break;
+   case '`':
+      pop(RCX);
+      pop(RAX);
+      emit(3, 0x48, 0x39, 0xc8); // cmp rax, rcx
+      emit(6, 0x0f, 0x9f, 0xc0, 0x0f, 0xb6, 0xc0); // setg al; movzx eax, al
+      cached = true;
+      break;
+
+   case ':':
+      pop(RAX);
+      push(RAX);
+      cached = true;
+      break;
+   case '\\':
+      pop(RCX);
+      pop(RAX);
+      push(RCX);
+      cached = true;
+      break;
+   case '$':
+      if (cached) {
+         cached = false;
+         nonempty -= !checked;
+      } else if (!checked) {
+         if (nonempty) {
+            --nonempty;
+            emit(3, 0x49, 0xff, 0xcd); // dec r13
+         }
+      } else {
+         const size_t empty = label();
+         emit(3, 0x4d, 0x85, 0xed); // test r13, r13
+         jump(CC_E, empty);
+         emit(3, 0x49, 0xff, 0xcd); // dec r13
+         bind(empty);
+      }
+      break;
+   case 'n':
+      cached  = false;
+      nconsts = 0;
+      emit(3, 0x4d, 0x31, 0xed); // xor r13, r13
+      break;
+
+   case '_': case '|': {
+      const mushcoords2
+         zero    = c == '_' ? MUSHCOORDS2(1,0) : MUSHCOORDS2(0,1),
+         nonzero = MUSHCOORDS2(-zero.x, -zero.y);
+      const bool was_nonzero = eq(s->next, nonzero);
+      pop(RAX);
+      test_rr(RAX);
+      jump(was_nonzero ? CC_E : CC_NE,
+           exit_to(s->after, was_nonzero ? zero : nonzero, refund));
+      break;
+   }
+   case 'w': {
+      const mushcoords2 d = s->delta;
+      const struct { int cond; mushcoords2 to; } ways[] = {
+         {CC_G, MUSHCOORDS2( d.y, -d.x)},
+         {CC_L, MUSHCOORDS2(-d.y,  d.x)},
+         {CC_E, d},
+      };
+      pop(RCX);
+      pop(RAX);
+      emit(3, 0x48, 0x39, 0xc1); // cmp rcx, rax
+      for (size_t i = 0; i < sizeof ways / sizeof *ways; ++i)
+         if (!eq(ways[i].to, s->next))
+            jump(ways[i].cond, exit_to(s->after, ways[i].to, refund));
+      break;
+   }
+
+   case 'g':
+      pop(RSI);
+      pop(RDI);
+      call((uintptr_t)hooks.get);
+      cached = true;
+      break;
+   case 'p':
+      pop(RSI);
+      pop(RDI);
+      pop(RDX);
+      call((uintptr_t)put);
+      emit(2, 0x84, 0xc0); // test al, al
+      jump(CC_NE, exit_to(s->after, s->next, refund));
+      break;
+   case '.': case ',':
+      pop(RDI);
+      call((uintptr_t)(c == '.' ? hooks.print_number : hooks.print_char));
+      break;
+
+   default:
+      return strchr("#<>[]^rvz", (int)c);
+   }
+   return false;
+}
+
+// The fewest cells the stack must hold at the start of a pass for none of
+// its pops to find it empty. After an n, nothing depends on that any more.
+static size_t min_depth(void) {
+   ptrdiff_t depth = 0;
+   size_t need = 0;
+   for (size_t i = 0; i < rec_len; ++i) {
+      const JitStep *s = &rec_steps[i];
+      if (!s->string && s->c == 'n')
+         break;
+      size_t pops, pushes;
+      stack_effect(s, &pops, &pushes);
+      depth -= (ptrdiff_t)pops;
+      if (depth < 0 && (size_t)-depth > need)
+         need = (size_t)-depth;
+      depth += (ptrdiff_t)pushes;
+   }
+   return need;
+}
+
+// Generates a pass of the loop, returning whether it's pure.
+static bool gen_pass(bool check, size_t head) {
+   checked = check;
+
+   // Once n has been executed, the exact depth is known.
+   bool cleared = false;
+   size_t depth = 0;
+
+   bool pure = true;
+   for (size_t i = 0; i < rec_len; ++i) {
+      const JitStep *s = &rec_steps[i];
+      size_t pops, pushes;
+      stack_effect(s, &pops, &pushes);
+      nonempty = cleared && depth < pops ? depth : pops;
+      pure &= gen(s, rec_len - 1 - i);
+
+      if (!s->string && s->c == 'n') {
+         cleared = true;
+         depth   = 0;
+      } else if (cleared)
+         depth = (depth > pops ? depth - pops : 0) + pushes;
+   }
+   flush();
+   jump(JMP, head);
+   return pure;
+}
+
+// Collects the cells read while recording, merging overlapping segments.
+static void find_segments(Trace *t) {
+   t->segs  = malloc(rec_len * sizeof *t->segs);
+   t->nsegs = 0;
+   for (size_t i = 0; i < rec_len; ++i) {
+      const mushcoords2 *next =
+         i + 1 < rec_len ? &rec_steps[i + 1].pos : &rec_head->pos;
+      Segment seg = segment(&rec_steps[i], next);
+      t->wraps |= whole_line(&seg);
+      size_t j = 0;
+      for (; j < t->nsegs; ++j) {
+         Segment *old = &t->segs[j];
+         if (old->row == seg.row && old->line == seg.line
+          && old->from <= seg.to && old->to >= seg.from)
+         {
+            if (seg.from < old->from) old->from = seg.from;
+            if (seg.to   > old->to)   old->to   = seg.to;
+            break;
+         }
+      }
+      if (j == t->nsegs)
+         t->segs[t->nsegs++] = seg;
+   }
+}
+
+static bool compile(void) {
+   if (nlive == MAX_TRACES)
+      return false;
+
+   Trace *t = calloc(1, sizeof *t);
+   find_segments(t);
+
+   buf_len = labels_len = fixups_len = exits_len = 0;
+   cached  = false;
+   nconsts = 0;
+
+   const size_t n = rec_len;
+   const size_t body = label(), head = label(), epilogue = label();
+   const JitStep *last = &rec_steps[n - 1];
+   const size_t out_of_budget = exit_to(last->after, last->next, 0);
+
+   // push rbx; push r12; push r13; push r14; push r15
+   emit(9, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+   mov_rr(RBX, RDI);
+   mov_rr(R15, RSI);
+   load_field(R12, offsetof(Stack_cell, array));
+   load_field(R13, offsetof(Stack_cell, head));
+   load_field(R14, offsetof(Stack_cell, capacity));
+
+   // The interpreter has already counted the first instruction.
+   charge((int32_t)n - 1);
+   jump(JMP, body);
+
+   // Leave a pass for the interpreter if it would hit a budget check.
+   bind(head);
+   emit(2, 0x48, 0xba);
+   imm64((uintptr_t)hooks.budget_slice);
+   emit(3, 0x48, 0x8b, 0x02); // mov rax, [rdx]
+   emit(2, 0x48, 0x3d);       // cmp rax, n
+   imm32((uint32_t)n);
+   jump(CC_BE, out_of_budget);
+   charge((int32_t)n);
+
+   // Pick the pass without underflow checks if the stack is deep enough.
+   bind(body);
+   const size_t need = min_depth(), shallow = label();
+   if (need) {
+      emit(3, 0x49, 0x81, 0xfd); // cmp r13, need
+      imm32((uint32_t)need);
+      jump(CC_B, shallow);
+   }
+   t->pure = gen_pass(false, head);
+   if (need) {
+      bind(shallow);
+      gen_pass(true, head);
+   }
+
+   for (size_t i = 0; i < exits_len; ++i) {
+      bind(exits[i].label);
+      if (exits[i].refund)
+         charge(-(int32_t)exits[i].refund);
+      emit(1, 0xb8); // mov eax, i
+      imm32((uint32_t)i);
+      jump(JMP, epilogue);
+   }
+
+   bind(epilogue);
+   store_field(offsetof(Stack_cell, head), R13);
+   // pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+   emit(10, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+
+   for (size_t i = 0; i < fixups_len; ++i) {
+      const uint32_t rel =
+         (uint32_t)(labels[fixups[i].label] - (fixups[i].at + 4));
+      memcpy(&buf[fixups[i].at], &rel, sizeof rel);
+   }
+
+   t->mem_len = buf_len;
+   t->mem = mmap(NULL, buf_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (t->mem == MAP_FAILED)
+      goto fail;
+   memcpy(t->mem, buf, buf_len);
+   if (mprotect(t->mem, buf_len, PROT_READ | PROT_EXEC)) {
+      munmap(t->mem, buf_len);
+      goto fail;
+   }
+   t->code  = (int (*)(Stack_cell *, CellContainer *))t->mem;
+   t->len   = n;
+   t->exits = malloc(exits_len * sizeof *t->exits);
+   for (size_t i = 0; i < exits_len; ++i)
+      t->exits[i] = exits[i].exit;
+
+   t->head = rec_head;
+   rec_head->trace = t;
+   t->next = live;
+   live = t;
+   ++nlive;
+   if (t->wraps) {
+      wrap_bounds = rec_bounds;
+      ++nwrapping;
+   }
+   remark_lines();
+   return true;
+
+fail:
+   free(t->segs);
+   free(t);
+   return false;
+}
+
+//////////////////////////////////////////// Running
+
+bool jit_enter(mushcoords2 pos, mushcoords2 *delta, CellContainer *cc,
+               mushcoords2 *after)
+{
+   free_dead();
+
+   Head *h = &heads[hash(pos, *delta) % HEADS];
+   if (!eq(h->pos, pos) || !eq(h->delta, *delta)) {
+      if (h->trace)
+         return false;
+      h->pos   = pos;
+      h->delta = *delta;
+      h->count = 0;
+   }
+
+   Trace *t = h->trace;
+   if (!t) {
+      if (++h->count >= HOT
+       && (delta->x == 0) != (delta->y == 0))
+      {
+         rec_head = h;
+         rec_len  = 0;
+         hooks.bounds(&rec_bounds);
+         jit_recording = true;
+      }
+      return false;
+   }
+
+#ifdef MODE
+   if (cc->isDeque)
+      return false;
+   Stack_cell *stack = &cc->u.stack;
+#else
+   Stack_cell *stack = cc;
+#endif
+   // The code doesn't know about runs of zeros kept out of the array.
+   if (stack->zerosLen)
+      return false;
+
+   // The code charges for the rest of the first pass up front.
+   if (*hooks.budget_slice < t->len)
+      return false;
+
+   if (!t->pure)
+      *hooks.tainted = true;
+   running = t;
+   const Exit *e = &t->exits[t->code(stack, cc)];
+   running = NULL;
+   *after = e->after;
+   *delta = e->delta;
+   return true;
+}
+
+void jit_record(const JitStep *s) {
+   if (rec_len && !s->string
+    && eq(s->pos, rec_head->pos) && eq(s->delta, rec_head->delta))
+   {
+      jit_recording = false;
+      if (!compile())
+         back_off(rec_head);
+      return;
+   }
+   if (rec_len == MAX_STEPS || !supported(s)
+    || (s->next.x == 0) == (s->next.y == 0))
+   {
+      stop_recording();
+      return;
+   }
+   rec_steps[rec_len++] = *s;
+}
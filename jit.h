@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 19:02:17
+
+// A tracing JIT to x86-64 machine code, enabled with -DJIT. The interpreter
+// counts how often each branch or direction change is reached with a given
+// delta. Once one is hot, the instructions executed from there until the
+// cursor comes back to it with the same delta are recorded, and if they're
+// all supported, compiled into a loop. Branches become guards that leave the
+// loop when they go the other way than they did while recording.
+//
+// A trace is only valid while the cells it passed over stay as they were, so
+// every write to Funge-space must be reported through jit_wrote() or
+// jit_wrote_all(). Only cardinal deltas are traced, so between instructions
+// the cursor reads the cells of a row or column up to the next one, or all
+// of it if it wrapped around. A write to any of those invalidates the trace.
+// Where a wrapping cursor lands depends on the bounds of Funge-space, so a
+// write outside them invalidates the traces that wrapped, and anything that
+// shrinks them must call jit_wrote_all().
+//
+// The compiled code keeps the top of the stack in a register, works directly
+// on the array of a Stack_cell, and calls back into the interpreter for g, p
+// and output. It charges the budget in bulk, one pass of the loop at a time.
+// Arithmetic and branches on values pushed by digits, ' and stringmode are
+// done while compiling, since they can only change along with the trace.
+// Before each pass, a single comparison against the fewest cells the pass
+// needs picks between a copy of the loop whose pops don't check for an empty
+// stack and one whose pops do.
+
+#ifndef JIT_H
+#define JIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+typedef struct {
+   // g and p, offset by the storage offset.
+   cell (*get)(cell x, cell y);
+   void (*put)(cell x, cell y, cell v);
+
+   // . and , respectively.
+   void (*print_number)(cell);
+   void (*print_char)(cell);
+
+   // The loose bounds of Funge-space.
+   void (*bounds)(mushbounds2 *);
+
+   // The instructions left until the next budget check, the number of
+   // instructions executed (may be NULL), and whether an instruction other
+   // than a direction change has been executed.
+   uint_fast32_t *budget_slice;
+   uintmax_t *instructions;
+   bool *tainted;
+} JitHooks;
+
+// The step about to be executed, and what it did once it's been executed.
+typedef struct {
+   mushcoords2 pos, delta;
+   cell c;
+   bool string;
+
+   // The cursor's position and delta afterwards, and for ' the value pushed.
+   mushcoords2 after, next;
+   cell value;
+} JitStep;
+
+extern bool jit_recording;
+
+void jit_init(const JitHooks *);
+void jit_free(void);
+
+// Whether it's worth calling jit_enter() before executing the instruction.
+static inline bool jit_may_enter(cell c) {
+   switch (c) {
+   case '_': case '|': case 'w':
+   case '>': case '<': case '^': case 'v': case '[': case ']': case 'r':
+      return true;
+   default:
+      return false;
+   }
+}
+
+// Called before executing the instruction at pos, unless recording. If there
+// is compiled code for pos and *delta, runs it and returns true, having set
+// *after and *delta to what they were after the last instruction it executed.
+// The caller should then advance the cursor from *after as usual.
+bool jit_enter(mushcoords2 pos, mushcoords2 *delta, CellContainer *,
+               mushcoords2 *after);
+
+// Called after every step while recording.
+void jit_record(const JitStep *);
+
+void jit_wrote(mushcoords2);
+void jit_wrote_all(void);
+
+#endif
@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 20:14:36
+
+#include "linecache.h"
+
+static LineCacheLine *find(
+   LineCache *cache, bool vertical, cell across, cell along)
+{
+   uint64_t h = (uint64_t)across * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)along  * 0xc2b2ae3d27d4eb4fu
+              ^ vertical;
+   return &cache->lines[(h >> 32) % LINE_CACHE_LINES];
+}
+
+static void record(LineCacheLine *line, size_t i, cell c) {
+   const uint64_t bit = (uint64_t)1 << i;
+   line->cells[i] = c;
+   line->valid   |= bit;
+   line->spaces   = c == ' ' ? line->spaces | bit : line->spaces & ~bit;
+   line->semis    = c == ';' ? line->semis  | bit : line->semis  & ~bit;
+}
+
+static mushcoords2 pos_of(const LineCacheLine *line, cell i) {
+   const cell c = line->along + i;
+   return line->vertical ? MUSHCOORDS2(line->across, c)
+                         : MUSHCOORDS2(c, line->across);
+}
+
+static bool holds(const LineCacheLine *line, bool vertical, cell across,
+                  cell along)
+{
+   return line->vertical == vertical
+       && line->across == across && line->along == along;
+}
+
+// Puts the cursor in the run holding pos along delta, evicting whatever
+// shared its line. Returns false if delta isn't a unit one.
+static bool enter(LineCache *cache, mushcoords2 pos, mushcoords2 delta) {
+   const bool vertical = !delta.x;
+   const cell d = vertical ? delta.y : delta.x;
+   if ((vertical ? delta.x : delta.y) || (d != 1 && d != -1)) {
+      cache->at = NULL;
+      return false;
+   }
+
+   const cell across = vertical ? pos.x : pos.y,
+              c      = vertical ? pos.y : pos.x,
+              along  = c & ~(cell)(LINE_CACHE_LEN - 1);
+
+   LineCacheLine *line = find(cache, vertical, across, along);
+   if (!holds(line, vertical, across, along)) {
+      line->vertical = vertical;
+      line->across   = across;
+      line->along    = along;
+      line->valid    = 0;
+   }
+   cache->at = line;
+   cache->i  = (size_t)(c - along);
+   return true;
+}
+
+void line_cache_init(LineCache *cache, cell (*get)(mushcoords2)) {
+   line_cache_clear(cache);
+   cache->get = get;
+}
+
+void line_cache_seek(LineCache *cache, mushcoords2 pos, mushcoords2 delta,
+                     cell c)
+{
+   if (enter(cache, pos, delta))
+      record(cache->at, cache->i, c);
+}
+
+// The slow path of line_cache_advance(): off the end of the run, or turning.
+void line_cache_step(LineCache *cache, mushcoords2 delta) {
+   const mushcoords2 pos = pos_of(cache->at, (cell)cache->i);
+   enter(cache, mushcoords2_add(pos, delta), delta);
+}
+
+bool line_cache_skip(LineCache *cache, mushcoords2 delta,
+                     const mushbounds2 *bounds, cell *c, cell *moved)
+{
+   LineCacheLine *line = cache->at;
+   if (!line)
+      return false;
+   const bool vertical = line->vertical;
+   const cell d = vertical ? delta.y : delta.x;
+   if ((vertical ? delta.x : delta.y) || (d != 1 && d != -1))
+      return false;
+
+   // Past the bounds, only wrapping around can find anything.
+   const cell across = line->across,
+              lo     = vertical ? bounds->beg.y : bounds->beg.x,
+              hi     = vertical ? bounds->end.y : bounds->end.x;
+   if (across < (vertical ? bounds->beg.x : bounds->beg.y)
+    || across > (vertical ? bounds->end.x : bounds->end.y))
+      return false;
+
+   bool comment = false;
+   cell i = (cell)cache->i, n = 0;
+   for (;;) {
+      if (line->along + i < lo || line->along + i > hi)
+         return false;
+      if (i < 0 || i >= LINE_CACHE_LEN) {
+         enter(cache, pos_of(line, i), delta);
+         line = cache->at;
+         i    = (cell)cache->i;
+      }
+      if (!(line->valid >> i & 1))
+         record(line, (size_t)i, cache->get(pos_of(line, i)));
+
+      // Skip whatever's known to be skippable in one go: spaces, or within
+      // a comment everything but semicolons.
+      const uint64_t skip = line->valid
+                          & (comment ? ~line->semis : line->spaces);
+      const uint64_t stop = d > 0 ? ~skip >> i
+                                  : ~skip << (LINE_CACHE_LEN - 1 - i);
+      const cell j = !stop ? (d > 0 ? LINE_CACHE_LEN : -1)
+                   : d > 0 ? i + __builtin_ctzll(stop)
+                   :         i - __builtin_clzll(stop);
+      n += (j - i) * d;
+      i  = j;
+      if (i < 0 || i >= LINE_CACHE_LEN || !(line->valid >> i & 1))
+         continue;
+
+      const cell here = line->cells[i];
+      if (here == ';')
+         comment = !comment;
+      else if (!comment && here != ' ')
+         break;
+      i += d;
+      ++n;
+   }
+   cache->i = (size_t)i;
+   *c       = line->cells[i];
+   *moved   = n;
+   return true;
+}
+
+void line_cache_put(LineCache *cache, mushcoords2 pos, cell c) {
+   const cell mask = ~(cell)(LINE_CACHE_LEN - 1);
+
+   LineCacheLine *row = find(cache, false, pos.y, pos.x & mask);
+   if (holds(row, false, pos.y, pos.x & mask))
+      record(row, (size_t)(pos.x & ~mask), c);
+
+   LineCacheLine *col = find(cache, true, pos.x, pos.y & mask);
+   if (holds(col, true, pos.x, pos.y & mask))
+      record(col, (size_t)(pos.y & ~mask), c);
+}
+
+void line_cache_invalidate(LineCache *cache, mushcoords2 pos) {
+   const cell mask = ~(cell)(LINE_CACHE_LEN - 1);
+
+   LineCacheLine *row = find(cache, false, pos.y, pos.x & mask),
+                 *col = find(cache, true,  pos.x, pos.y & mask);
+   if (holds(row, false, pos.y, pos.x & mask))
+      row->valid &= ~((uint64_t)1 << (pos.x & ~mask));
+   if (holds(col, true, pos.x, pos.y & mask))
+      col->valid &= ~((uint64_t)1 << (pos.y & ~mask));
+}
+
+void line_cache_clear(LineCache *cache) {
+   for (size_t i = 0; i < LINE_CACHE_LINES; ++i)
+      cache->lines[i].valid = 0;
+}
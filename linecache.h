@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 20:14:36
+
+// A cache of the cells around the main cursor, enabled with -DLINE_CACHE.
+// Nearly all execution happens with the unit deltas set by > < ^ and v, for
+// which the next instruction is almost always the very next cell. Finding it
+// with mushcursor2_skip_markers() means handling arbitrary deltas, markers
+// and wraparound every time, so instead the cache holds runs of
+// LINE_CACHE_LEN cells along rows and columns, and an index into the one the
+// cursor is in that's stepped along with it.
+//
+// Cells are filled in as the cursor finds them by other means, so a miss
+// costs no more than not having the cache. The cursor's run is lost whenever
+// it moves in any other way than by a unit delta.
+//
+// Each run also has bitmasks of its known spaces and semicolons, so that
+// line_cache_skip() can skip over a run's worth of spaces, or of a comment
+// between semicolons, with a single bit scan. It fetches unknown cells as it
+// goes, but leaves wrapping around at the bounds of Funge-space to
+// mushspace. Writes to Funge-space must be reported as with
+// GP_CACHE.
+
+#ifndef LINECACHE_H
+#define LINECACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+// LINE_CACHE_LEN can't be more than the bits in LineCacheLine.valid.
+enum { LINE_CACHE_LEN = 64, LINE_CACHE_LINES = 64 };
+
+typedef struct {
+   // For a row, its y and the x of its first cell; for a column, its x and
+   // the y of its first cell.
+   cell across, along;
+   bool vertical;
+   uint64_t valid;
+
+   // Which of the valid cells are spaces and semicolons respectively.
+   uint64_t spaces, semis;
+
+   cell cells[LINE_CACHE_LEN];
+} LineCacheLine;
+
+typedef struct {
+   LineCacheLine lines[LINE_CACHE_LINES];
+
+   // The run the cursor is in and its index in it. NULL if not known.
+   LineCacheLine *at;
+   size_t i;
+
+   // Reads a cell from Funge-space, bypassing any other caches.
+   cell (*get)(mushcoords2);
+} LineCache;
+
+void line_cache_init(LineCache *, cell (*get)(mushcoords2));
+
+// Called after the cursor has found the cell c at pos by other means.
+void line_cache_seek(LineCache *, mushcoords2 pos, mushcoords2 delta, cell c);
+
+void line_cache_step(LineCache *, mushcoords2 delta);
+
+// The cell under the cursor, if known.
+static inline bool line_cache_get(const LineCache *cache, cell *c) {
+   const LineCacheLine *line = cache->at;
+   if (!line || !(line->valid >> cache->i & 1))
+      return false;
+   *c = line->cells[cache->i];
+   return true;
+}
+
+// Called whenever the cursor is advanced by delta.
+static inline void line_cache_advance(LineCache *cache, mushcoords2 delta) {
+   const LineCacheLine *line = cache->at;
+   if (!line)
+      return;
+   const cell d     = line->vertical ? delta.y : delta.x,
+              other = line->vertical ? delta.x : delta.y;
+   const size_t i = cache->i + (size_t)d;
+   if (!other && (d == 1 || d == -1) && i < LINE_CACHE_LEN)
+      cache->i = i;
+   else
+      line_cache_step(cache, delta);
+}
+
+// Called when the cell under the cursor is unknown, a space, or a semicolon.
+// Returns true if it found the next instruction along delta without leaving
+// the given bounds of Funge-space, putting it in *c and how many cells away
+// it is in *moved, and leaving the cache at it. The cursor then needs to be
+// advanced by that many deltas without telling the cache.
+bool line_cache_skip(LineCache *, mushcoords2 delta, const mushbounds2 *,
+                     cell *c, cell *moved);
+
+// Called whenever the cursor is moved other than by advancing it.
+static inline void line_cache_drop(LineCache *cache) { cache->at = NULL; }
+
+void line_cache_put(LineCache *, mushcoords2, cell);
+void line_cache_invalidate(LineCache *, mushcoords2);
+void line_cache_clear(LineCache *);
+
+#endif
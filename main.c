@@ -2,8 +2,9 @@
 // This file is part of Hali.
 // File created: 2012-10-31 19:16:56
 
-#define _POSIX_SOURCE
+#define _POSIX_C_SOURCE 200809L
 #include <errno.h>
+#include <inttypes.h>
 #include <setjmp.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -12,15 +13,50 @@
 #include <string.h>
 
 #include <fcntl.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <mush/cursor.h>
 #include <mush/space.h>
 
+#include "input.h"
 #include "stack.h"
 
+#ifdef PROFILE
+#include "profile.h"
+#endif
+#ifdef SAMPLE
+#include "sample.h"
+#endif
+#ifdef TRACE
+#include "trace.h"
+#endif
+#ifdef PUTBUF
+#include "putbuf.h"
+#endif
+#ifdef GP_CACHE
+#include "gpcache.h"
+#endif
+#ifdef LINE_CACHE
+#include "linecache.h"
+#endif
+#ifdef AOT
+#include "aot.h"
+#endif
+#ifdef JIT
+#include "jit.h"
+#endif
+
+_Static_assert(sizeof(cell) == sizeof(mushcell),
+               "mushspace must be built with cells of CELL_BITS bits");
+
 typedef struct {
    char *ptr;
    size_t len;
@@ -33,9 +69,12 @@ static void     push_string(CellContainer *cc, char_arr  arr);
 static char_arr strn_buf = {NULL, 0};
 
 static mushcursor2 *strn_cursor = NULL;
-static cell cells_length_n;
-static int strn_put_foreach(cell *c);
-static int cells_length(cell *c);
+static size_t string_length(CellContainer*);
+static size_t string_put(CellContainer*);
+
+static bool files_allowed(void);
+static bool input_file(const char*, bool, mushcoords2, mushcoords2*);
+static bool output_file(const char*, bool, mushcoords2, mushcoords2);
 
 static mushspace2 *space;
 static mushcoords2 delta, offset;
@@ -47,13 +86,170 @@ static Stack_stack stackstack_buf, *stackstack = NULL;
 static bool stringmode = false,
             strn_enabled = false;
 
+// Accesses to Funge-space other than through the main cursor. With PUTBUF,
+// space_sync() must be called before reading or writing through any cursor
+// in a way that the main loop doesn't check for itself. With GP_CACHE,
+// LINE_CACHE or JIT, space_wrote() must be called after writing through one.
+#ifdef PUTBUF
+static mushcoords2 fetch_from;
+#endif
+#ifdef GP_CACHE
+static GpCache gp_cache;
+#endif
+#ifdef LINE_CACHE
+static LineCache line_cache;
+
+static cell space_get_uncached(mushcoords2 pos) {
+#ifdef PUTBUF
+   return putbuf_get(space, pos);
+#else
+   return mushspace2_get(space, pos);
+#endif
+}
+#endif
+
+static cell space_get(mushcoords2 pos) {
+   cell c;
+#ifdef GP_CACHE
+   if (gp_cache_get(&gp_cache, pos, &c))
+      return c;
+#endif
+#ifdef PUTBUF
+   c = putbuf_get(space, pos);
+#else
+   c = mushspace2_get(space, pos);
+#endif
+#ifdef GP_CACHE
+   gp_cache_set(&gp_cache, pos, c);
+#endif
+   return c;
+}
+static void space_put(mushcoords2 pos, cell c) {
+#ifdef JIT
+   jit_wrote(pos);
+#endif
+#ifdef GP_CACHE
+   gp_cache_set(&gp_cache, pos, c);
+#endif
+#ifdef LINE_CACHE
+   line_cache_put(&line_cache, pos, c);
+#endif
+#ifdef PUTBUF
+   putbuf_put(space, pos, c);
+#else
+   mushspace2_put(space, pos, c);
+#endif
+}
+
+static void space_sync(void) {
+#ifdef PUTBUF
+   putbuf_flush(space);
+#endif
+}
+static void space_sync_at(mushcoords2 pos) {
+#ifdef PUTBUF
+   if (putbuf_holds(pos))
+      putbuf_flush(space);
+#endif
+   (void)pos;
+}
+
+// Called after a write through a cursor to the given position.
+static void space_wrote(mushcoords2 pos) {
+#ifdef GP_CACHE
+   gp_cache_invalidate(&gp_cache, pos);
+#endif
+#ifdef LINE_CACHE
+   line_cache_invalidate(&line_cache, pos);
+#endif
+#ifdef JIT
+   jit_wrote(pos);
+#endif
+   (void)pos;
+}
+
+// Called after writing to Funge-space other than a cell at a time.
+static void space_wrote_all(void) {
+#ifdef GP_CACHE
+   gp_cache_clear(&gp_cache);
+#endif
+#ifdef LINE_CACHE
+   line_cache_clear(&line_cache);
+#endif
+#ifdef JIT
+   jit_wrote_all();
+#endif
+}
+
+// Moves the main cursor. With LINE_CACHE, the cache must be told about it.
+static void advance(mushcoords2 d) {
+   mushcursor2_advance(cursor, d);
+#ifdef LINE_CACHE
+   line_cache_advance(&line_cache, d);
+#endif
+}
+static void set_pos(mushcoords2 pos) {
+   mushcursor2_set_pos(cursor, pos);
+#ifdef LINE_CACHE
+   line_cache_drop(&line_cache);
+#endif
+}
+
+#ifdef LINE_CACHE
+// Skips markers with the line cache if it can, moving the cursor to the
+// instruction it finds. With PUTBUF, not while writes are buffered: they
+// could lead the cursor outside mushspace's bounds.
+static bool skip_cached(cell *c) {
+#ifdef PUTBUF
+   if (putbuf_len)
+      return false;
+#endif
+   mushbounds2 bounds;
+   mushspace2_get_loose_bounds(space, &bounds);
+   cell n;
+   if (!line_cache_skip(&line_cache, delta, &bounds, c, &n))
+      return false;
+   mushcursor2_advance(cursor, MUSHCOORDS2(delta.x * n, delta.y * n));
+   return true;
+}
+#endif
+
+#ifdef STATS
+// The number of instructions executed, counting each character pushed in
+// stringmode as one. Printed on stderr at exit for the benefit of
+// bench/corpus_bench.c.
+static uintmax_t instructions = 0;
+#endif
+
+#ifdef STATS
+static void space_report(const char *arg0);
+static void stack_report(const char *arg0);
+#endif
+
+// Prints whatever we've been built to collect about the run.
+static void report(const char *arg0) {
+#ifdef TRACE
+   trace_record_stop();
+#endif
+#ifdef SAMPLE
+   sample_stop();
+#endif
+#ifdef STATS
+   fprintf(stderr, "%s: %ju instructions\n", arg0, instructions);
+   space_report(arg0);
+   stack_report(arg0);
+#endif
+#ifdef PROFILE
+   profile_report(stderr, arg0);
+#endif
+   (void)arg0;
+}
+
 static int execute(cell i);
 
-static cell *block_transfer_p;
-static void block_transfer_f(cell*, size_t);
-static void block_transfer_g(size_t);
-static void stack_under_stack_f(cell*, size_t);
-static void stack_under_stack_g(size_t);
+static inline void copy_top(cell*, CellContainer*, size_t, bool);
+static size_t underflow_zeros(CellContainer*, CellContainer*, cell);
+static size_t clamp_size(ucell);
 
 static void handler(musherr err, void* unused, void* vjmp) {
    (void)unused;
@@ -72,12 +268,741 @@ static int fail(const char *arg0, const char *s) {
    return 2;
 }
 
+// Funge-space only ever grows: a program that writes something far away and
+// later clears it keeps the memory for it. So every SPACE_CHECK_PERIOD budget
+// checks, if the loose bounds have grown past SPACE_COMPACT_MIN_AREA cells
+// since last time, they're compared to the tight bounds. If those are much
+// smaller, the contents are copied into a fresh space and the old one freed.
+//
+// The cells in the tight bounds are all visited, so spaces whose tight
+// bounds are too large are left alone.
+enum {
+   SPACE_CHECK_PERIOD     = 64,
+   SPACE_COMPACT_MIN_AREA = 1 << 20,
+   SPACE_COMPACT_MAX_AREA = 1 << 24,
+};
+
+static jmp_buf *infloop_jmp;
+static unsigned space_checks = 0;
+static uintmax_t space_checked_area = 0, space_compactions = 0;
+
+// The area of the given bounds, or UINTMAX_MAX if it doesn't fit.
+static uintmax_t area(const mushbounds2 *b) {
+   if (b->end.x < b->beg.x || b->end.y < b->beg.y)
+      return 0;
+   uintmax_t w = (uintmax_t)b->end.x - b->beg.x + 1,
+             h = (uintmax_t)b->end.y - b->beg.y + 1;
+   return h > UINTMAX_MAX / w ? UINTMAX_MAX : w * h;
+}
+
+static void compact_space(const mushbounds2 *tight) {
+   mushspace2 *fresh = mushspace2_init(NULL, NULL);
+   for (cell y = tight->beg.y; y <= tight->end.y; ++y) {
+      for (cell x = tight->beg.x; x <= tight->end.x; ++x) {
+         cell c = mushspace2_get(space, MUSHCOORDS2(x, y));
+         if (c != ' ')
+            mushspace2_put(fresh, MUSHCOORDS2(x, y), c);
+      }
+   }
+
+   // With SAMPLE, the cursor may be read from a signal handler at any time,
+   // so the new ones are swapped in before the old ones are freed.
+   mushspace2  *old_space       = space;
+   mushcursor2 *old_cursor      = cursor,
+               *old_strn_cursor = strn_cursor;
+   mushcursor2 *fresh_cursor =
+      mushcursor2_init(NULL, fresh, mushcursor2_get_pos(old_cursor));
+   mushcursor2 *fresh_strn_cursor =
+      mushcursor2_init(NULL, fresh, mushcursor2_get_pos(old_strn_cursor));
+
+   space       = fresh;
+   cursor      = fresh_cursor;
+   strn_cursor = fresh_strn_cursor;
+   mushspace2_set_handler(space, handler, infloop_jmp);
+
+   mushcursor2_free(old_strn_cursor); free(old_strn_cursor);
+   mushcursor2_free(old_cursor); free(old_cursor);
+   mushspace2_free(old_space); free(old_space);
+
+   // The bounds shrank, which moves where the cursor wraps to.
+   space_wrote_all();
+
+#ifdef __GLIBC__
+   malloc_trim(0);
+#endif
+   ++space_compactions;
+}
+
+static void maybe_compact_space(void) {
+   if (++space_checks % SPACE_CHECK_PERIOD)
+      return;
+
+   mushbounds2 loose, tight;
+   mushspace2_get_loose_bounds(space, &loose);
+   const uintmax_t loose_area = area(&loose);
+   if (loose_area < SPACE_COMPACT_MIN_AREA
+    || loose_area <= space_checked_area)
+      return;
+   space_checked_area = loose_area;
+
+   space_sync();
+   if (!mushspace2_get_tight_bounds(space, &tight)) {
+      // Nothing but spaces: an empty range.
+      tight.beg = MUSHCOORDS2(1,1);
+      tight.end = MUSHCOORDS2(0,0);
+   }
+   const uintmax_t tight_area = area(&tight);
+   if (tight_area <= SPACE_COMPACT_MAX_AREA && tight_area < loose_area / 4) {
+      compact_space(&tight);
+      mushspace2_get_loose_bounds(space, &loose);
+      space_checked_area = area(&loose);
+   }
+}
+
+#ifdef STATS
+static void space_report(const char *arg0) {
+   space_sync();
+   mushbounds2 loose, tight;
+   mushspace2_get_loose_bounds(space, &loose);
+   fprintf(stderr, "%s: Funge-space: %ju cells in loose bounds",
+           arg0, area(&loose));
+   if (mushspace2_get_tight_bounds(space, &tight)) {
+      uintmax_t n = area(&tight), used = 0;
+      fprintf(stderr, ", %ju in tight bounds", n);
+      if (n <= SPACE_COMPACT_MAX_AREA) {
+         for (cell y = tight.beg.y; y <= tight.end.y; ++y)
+            for (cell x = tight.beg.x; x <= tight.end.x; ++x)
+               used += mushspace2_get(space, MUSHCOORDS2(x, y)) != ' ';
+         fprintf(stderr, ", %ju not spaces", used);
+      }
+   }
+   fprintf(stderr, "; compacted %ju times\n", space_compactions);
+}
+
+static void stack_report(const char *arg0) {
+   size_t n = 1, room = 0, peak = stack_peak_capacity;
+   if (stackstack)
+      n = stack_stack_size(stackstack);
+   for (size_t i = 0; i < n; ++i) {
+      const CellContainer *s = stackstack ? stack_stack_at(stackstack, i) : cc;
+      const size_t c = cc_capacity(s);
+      room += c;
+      peak  = c > peak ? c : peak;
+   }
+   fprintf(stderr, "%s: stacks: room for %zu cells, at most %zu in one; "
+                   "shrunk %ju times\n", arg0, room, peak, stack_shrinks);
+}
+#endif
+
+// Limits on the resources the program may use, for running untrusted code.
+// Zero means no limit. Checking them after every instruction would cost too
+// much, so budget_slice counts down the instructions until the next check.
+//
+// A check on every instruction rather than only on direction changes is
+// needed because a single row of code wraps around forever without changing
+// direction. The countdown is just a decrement and a well-predicted branch.
+enum { BUDGET_SLICE = 1 << 16 };
+
+static uintmax_t limit_instructions = 0, limit_cells = 0, limit_kbytes = 0;
+static double    limit_seconds = 0;
+
+static uint_fast32_t budget_slice, budget_slice_len;
+static uintmax_t budget_used = 0, budget_cells_left = UINTMAX_MAX;
+static struct timespec budget_deadline;
+
+// The name of the budget that ran out, if one did.
+static const char *exhausted = NULL;
+
+// Cycles that mushspace can't see, such as ">v" over "^<", are caught in the
+// budget checks. An instruction is pure if all it can do is move the cursor
+// or change delta to something depending only on the previous delta. While
+// nothing but pure instructions are executed, the stacks and Funge-space stay
+// as they are, so the next state depends only on the position and delta.
+// Executed positions lie within the bounds and only 8 deltas are reachable
+// (the 4 rotations of the starting delta and the 4 cardinal directions), so
+// a run of more pure instructions than 8 times the area of the bounds must
+// have repeated a state and will keep doing so forever.
+//
+// Cycles through impure instructions aren't caught: unchanged stack height,
+// for instance, doesn't mean that the values on the stack haven't changed
+// the branches taken.
+static const uint64_t pure_instructions[2] = {
+   // # < >
+   1ull << '#' | 1ull << '<' | 1ull << '>',
+   // [ ] ^ r v z
+   1ull << ('[' - 64) | 1ull << (']' - 64) | 1ull << ('^' - 64)
+ | 1ull << ('r' - 64) | 1ull << ('v' - 64) | 1ull << ('z' - 64),
+};
+
+static inline bool is_pure(cell c) {
+   return c >= 0 && c < 128 && pure_instructions[c >> 6] >> (c & 63) & 1;
+}
+
+// Whether an impure instruction has been executed since the last check, and
+// how many pure instructions have been executed in a row before that.
+static bool tainted = true;
+static uintmax_t pure_run = 0;
+static bool infloop = false;
+
+// Called from over_budget() with the number of instructions since the last
+// check. Returns true if the cursor is certainly in an infinite loop.
+static bool looping(uintmax_t n) {
+   if (tainted) {
+      tainted  = false;
+      pure_run = 0;
+      return false;
+   }
+   pure_run += n;
+
+   space_sync();
+   mushbounds2 bounds;
+   mushspace2_get_loose_bounds(space, &bounds);
+   const uintmax_t a = area(&bounds);
+   return a && a <= UINTMAX_MAX / 8 && pure_run > 8 * a;
+}
+
+static size_t cells_total(void) {
+   if (!stackstack)
+      return cc_size(cc);
+   size_t n = 0;
+   for (size_t i = stack_stack_size(stackstack); i--;)
+      n += cc_size(stack_stack_at(stackstack, i));
+   return n;
+}
+
+static void budget_next_slice(void) {
+   // Make sure that the instruction one past the limit triggers a check.
+   uintmax_t left = limit_instructions - budget_used;
+   budget_slice = budget_slice_len =
+      limit_instructions && left < BUDGET_SLICE ? left + 1 : BUDGET_SLICE;
+}
+
+static void budget_start(void) {
+   if (limit_seconds) {
+      clock_gettime(CLOCK_MONOTONIC, &budget_deadline);
+      double whole = (double)(time_t)limit_seconds;
+      budget_deadline.tv_sec  += (time_t)limit_seconds;
+      budget_deadline.tv_nsec += (long)((limit_seconds - whole) * 1e9);
+      if (budget_deadline.tv_nsec >= 1000000000) {
+         budget_deadline.tv_nsec -= 1000000000;
+         ++budget_deadline.tv_sec;
+      }
+   }
+   if (limit_cells)
+      budget_cells_left = limit_cells;
+   budget_next_slice();
+}
+
+// Called when budget_slice reaches zero. Returns true if a budget has been
+// exhausted, in which case execution should stop.
+static bool over_budget(void) {
+   if (exhausted || infloop) {
+      budget_slice = 1;
+      return true;
+   }
+   uintmax_t n = budget_slice_len - budget_slice;
+   budget_used += n;
+
+   if (looping(n)) {
+      infloop = true;
+      budget_slice = 1;
+      return true;
+   }
+
+   if (limit_instructions && budget_used > limit_instructions)
+      exhausted = "instruction";
+
+   if (limit_seconds) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > budget_deadline.tv_sec
+       || (now.tv_sec == budget_deadline.tv_sec
+        && now.tv_nsec >= budget_deadline.tv_nsec))
+         exhausted = "time";
+   }
+
+   if (limit_cells) {
+      size_t n = cells_total();
+      if (n > limit_cells)
+         exhausted = "cell";
+      else
+         budget_cells_left = limit_cells - n;
+   }
+
+   maybe_compact_space();
+
+   // Those below the current stack are looked at once they're current again.
+   cc_shrink(cc);
+
+   if (limit_kbytes) {
+      struct rusage ru;
+      if (getrusage(RUSAGE_SELF, &ru) == 0
+       && (uintmax_t)ru.ru_maxrss > limit_kbytes)
+         exhausted = "memory";
+   }
+
+   if (exhausted) {
+      budget_slice = 1;
+      return true;
+   }
+   budget_next_slice();
+   return false;
+}
+
+// Called before an instruction grows the stacks by n cells at once. Returns
+// false if that would certainly break the cell limit, and otherwise makes
+// sure that the limit is checked after the instruction if it might.
+static bool budget_grow(uintmax_t n) {
+   if (limit_cells && n > limit_cells) {
+      exhausted = "cell";
+      budget_slice = 1;
+      return false;
+   }
+   if (n < budget_cells_left)
+      budget_cells_left -= n;
+   else {
+      budget_slice_len -= budget_slice - 1;
+      budget_slice = 1;
+   }
+   return true;
+}
+
+static bool parse_number(const char *s, uintmax_t *n) {
+   char *end;
+   errno = 0;
+   *n = strtoumax(s, &end, 10);
+   return *s >= '0' && *s <= '9' && !*end && !errno;
+}
+
+// Runs the program once per input file, each time in a child process reading
+// the file as its input and writing its output to the file's name with ".out"
+// appended, with at most jobs of them at a time. Funge-space has been loaded
+// by then, so all of them share this process's copy of it: only the pages a
+// run writes to are copied for it.
+//
+// Returns false in the children, which should go on to run the program, and
+// true once they're all done, with the worst exit status among them.
+static bool fork_runs(
+   const char *arg0, char **inputs, size_t n, uintmax_t jobs, int *status)
+{
+   pid_t *pids = malloc(n * sizeof *pids);
+   if (!pids) {
+      *status = fail(arg0, "malloc");
+      return true;
+   }
+   fflush(stdout);
+
+   *status = 0;
+   size_t started = 0, running = 0;
+   while (started < n || running) {
+      if (started < n && running < jobs) {
+         const pid_t pid = fork();
+         if (pid == 0) {
+            const char *in = inputs[started];
+            char *out = malloc(strlen(in) + sizeof ".out");
+            if (!out)
+               exit(fail(arg0, "malloc"));
+            strcat(strcpy(out, in), ".out");
+            if (!freopen(in, "r", stdin))
+               exit(fail(arg0, in));
+            if (!freopen(out, "w", stdout))
+               exit(fail(arg0, out));
+            free(out);
+            free(pids);
+            return false;
+         }
+         if (pid == -1) {
+            *status = fail(arg0, "fork");
+            n = started;
+            continue;
+         }
+         pids[started++] = pid;
+         ++running;
+         continue;
+      }
+
+      int ws;
+      const pid_t pid = wait(&ws);
+      if (pid == -1) {
+         *status = fail(arg0, "wait");
+         break;
+      }
+      --running;
+      int code = WIFEXITED(ws) ? WEXITSTATUS(ws) : 2;
+      if (WIFSIGNALED(ws)) {
+         size_t i = 0;
+         while (i < started && pids[i] != pid)
+            ++i;
+         fprintf(stderr, "%s: %s: killed by signal %d\n",
+                 arg0, i < started ? inputs[i] : "?", WTERMSIG(ws));
+      }
+      if (code > *status)
+         *status = code;
+   }
+   free(pids);
+   return true;
+}
+
+#ifdef SAMPLE
+static const char *sample_path = NULL;
+
+// Runs in a signal handler: compact_space() never leaves cursor dangling.
+static void sample_state(Sample *s) {
+   s->pos        = mushcursor2_get_pos(cursor);
+   s->delta      = delta;
+   s->depth      = stackstack ? stack_stack_size(stackstack) : 1;
+   s->stringmode = stringmode;
+}
+#endif
+
+#ifdef TRACE
+static bool tracing = false;
+
+// Gets the state out of the interpreter, for a checkpoint.
+static void trace_get_state(TraceState *st, const mushbounds2 *bounds) {
+   st->pos          = mushcursor2_get_pos(cursor);
+   st->delta        = delta;
+   st->offset       = offset;
+   st->stringmode   = stringmode;
+   st->strn_enabled = strn_enabled;
+
+   if (stackstack) {
+      st->nstacks = stack_stack_size(stackstack);
+      st->stacks  = malloc(st->nstacks * sizeof *st->stacks);
+      for (size_t i = 0; i < st->nstacks; ++i)
+         st->stacks[i] = stack_stack_at(stackstack, i);
+   } else {
+      st->nstacks = 1;
+      st->stacks  = malloc(sizeof *st->stacks);
+      st->stacks[0] = cc;
+   }
+
+   st->bounds = *bounds;
+   st->cells  = NULL;
+   if (bounds->end.x < bounds->beg.x || bounds->end.y < bounds->beg.y)
+      return;
+   size_t w = bounds->end.x - bounds->beg.x + 1,
+          h = bounds->end.y - bounds->beg.y + 1;
+   cell *p = st->cells = malloc(w * h * sizeof *st->cells);
+   for (cell y = bounds->beg.y; y <= bounds->end.y; ++y)
+      for (cell x = bounds->beg.x; x <= bounds->end.x; ++x)
+         *p++ = mushspace2_get(space, MUSHCOORDS2(x, y));
+}
+
+// Puts a state restored from a checkpoint into the interpreter, whose
+// Funge-space must be empty. Returns the position to start the cursor at.
+static mushcoords2 trace_set_state(TraceState *st) {
+   delta        = st->delta;
+   offset       = st->offset;
+   stringmode   = st->stringmode;
+   strn_enabled = st->strn_enabled;
+
+   cc_buf = *st->stacks[0];
+   free(st->stacks[0]);
+   if (st->nstacks > 1) {
+      stackstack_buf = stack_stack_init(st->nstacks);
+      stackstack = &stackstack_buf;
+      stack_stack_push(stackstack, &cc_buf);
+      for (size_t i = 1; i < st->nstacks; ++i)
+         stack_stack_push(stackstack, st->stacks[i]);
+      cc = st->stacks[st->nstacks - 1];
+   }
+   free(st->stacks);
+
+   const cell *p = st->cells;
+   if (p) {
+      // Only the non-spaces are put, but the loose bounds must come back as
+      // recorded: they decide how far the cursor wraps and when the budget
+      // checks think it's looping. So something goes in two opposite corners
+      // first, to be overwritten with what was there.
+      const mushbounds2 b = st->bounds;
+      mushspace2_put(space, b.beg, '!');
+      mushspace2_put(space, b.end, '!');
+      for (cell y = b.beg.y; y <= b.end.y; ++y)
+         for (cell x = b.beg.x; x <= b.end.x; ++x, ++p)
+            if (*p != ' ')
+               mushspace2_put(space, MUSHCOORDS2(x, y), *p);
+      mushspace2_put(space, b.beg, st->cells[0]);
+      mushspace2_put(space, b.end, p[-1]);
+   }
+   free(st->cells);
+   return st->pos;
+}
+
+// Called whenever trace_stop_due(). Returns true if execution should stop.
+static bool trace_stop(const char *arg0) {
+   if (trace_recording()) {
+      space_sync();
+      mushbounds2 bounds;
+      mushspace2_get_loose_bounds(space, &bounds);
+      if (!trace_checkpoint_wanted(&bounds)) {
+         trace_checkpoint(NULL);
+         return false;
+      }
+      TraceState st;
+      trace_get_state(&st, &bounds);
+      trace_checkpoint(&st);
+      free(st.stacks);
+      free(st.cells);
+      return false;
+   }
+
+   // We've replayed up to the requested instruction: show where we are.
+   mushcoords2 pos = mushcursor2_get_pos(cursor);
+   fprintf(stderr, "%s: stopped before instruction %ju at ( %ld %ld ), "
+                   "delta ( %ld %ld ), offset ( %ld %ld )%s\n",
+           arg0, trace_insns, (long)pos.x, (long)pos.y,
+           (long)delta.x, (long)delta.y, (long)offset.x, (long)offset.y,
+           stringmode ? ", in stringmode" : "");
+
+   size_t n = stackstack ? stack_stack_size(stackstack) : 1;
+   for (size_t s = n; s--;) {
+      const CellContainer *c = stackstack ? stack_stack_at(stackstack, s) : cc;
+      size_t len = cc_size(c);
+      fprintf(stderr, "%s: stack %zu, %zu cells, from the top:",
+              arg0, n - 1 - s, len);
+      char buf[CELL_DIGITS];
+      for (size_t i = len; i--;)
+         fprintf(stderr, " %s", cell_format(cc_at(c, i), buf));
+      fputc('\n', stderr);
+   }
+   return true;
+}
+#endif
+
+static void print_number(cell c) {
+   char buf[CELL_DIGITS];
+   fputs(cell_format(c, buf), stdout);
+   putchar_unlocked(' ');
+}
+static void print_char(cell c) {
+   putchar_unlocked((char)c);
+   if ((char)c == '\n')
+      fflush(stdout);
+}
+
+#ifdef JIT
+// Tracing and profiling need to see every instruction.
+static bool jit_enabled =
+#ifdef PROFILE
+   false;
+#else
+   true;
+#endif
+
+static cell get_offset(cell x, cell y) {
+   return space_get(MUSHCOORDS2(x + offset.x, y + offset.y));
+}
+static void put_offset(cell x, cell y, cell v) {
+   space_put(MUSHCOORDS2(x + offset.x, y + offset.y), v);
+}
+static void loose_bounds(mushbounds2 *bounds) {
+   space_sync();
+   mushspace2_get_loose_bounds(space, bounds);
+}
+#endif
+
+// Reads a value for & or ~ respectively, or consults the trace for it.
+// Returns false on EOF.
+static bool input(bool (*read)(cell *), cell *c) {
+#ifdef TRACE
+   if (trace_replaying())
+      return trace_replay_input(c);
+   *c = 0;
+   bool ok = read(c);
+   if (trace_recording())
+      trace_input(ok, *c);
+   return ok;
+#else
+   return read(c);
+#endif
+}
+
+// Finds the next cell in stringmode, leaving the cursor on it: a run of spaces
+// is a single space, the last one.
+static cell fetch_string(void) {
+   cell c;
+#ifdef LINE_CACHE
+   if (line_cache_get(&line_cache, &c) && c != ' ')
+      return c;
+#endif
+   mushcursor2_skip_to_last_space(cursor, delta, &c);
+#ifdef PUTBUF
+   if (putbuf_crossed(fetch_from, mushcursor2_get_pos(cursor), delta)) {
+      putbuf_flush(space);
+      set_pos(fetch_from);
+      mushcursor2_skip_to_last_space(cursor, delta, &c);
+   }
+#endif
+#ifdef LINE_CACHE
+   line_cache_seek(&line_cache, mushcursor2_get_pos(cursor), delta, c);
+#endif
+   return c;
+}
+
+// Whether push_string_run() may be used: not when something wants to see
+// each cell of a string separately.
+static bool bulk_strings(void) {
+#ifdef TRACE
+   if (tracing)
+      return false;
+#endif
+#ifdef JIT
+   if (jit_recording)
+      return false;
+#endif
+#ifdef MODE
+   // Invertmode would need the cells reversed.
+   if (cc->isDeque)
+      return false;
+#endif
+   return true;
+}
+
+// Called in stringmode with the cell c under the cursor, which isn't the
+// closing quote. Pushes it and the rest of the string up to the next budget
+// check, counting each cell as an instruction, and leaves the cursor on the
+// last cell it handled. That may be the closing quote.
+//
+// Instead of a trip around the main loop and a push for each cell, the cells
+// are gathered here and pushed a block at a time.
+static void push_string_run(cell c) {
+   cell buf[256];
+   size_t n = 0;
+   for (;;) {
+      buf[n++] = c;
+      if (n == sizeof buf / sizeof *buf) {
+         memcpy(cc_reserve(cc, n), buf, n * sizeof *buf);
+         n = 0;
+      }
+      if (budget_slice == 1)
+         break;
+
+      advance(delta);
+#ifdef PUTBUF
+      fetch_from = mushcursor2_get_pos(cursor);
+#endif
+      c = fetch_string();
+      --budget_slice;
+#ifdef STATS
+      ++instructions;
+#endif
+      if (c == '"') {
+         stringmode = false;
+         break;
+      }
+   }
+   if (n)
+      memcpy(cc_reserve(cc, n), buf, n * sizeof *buf);
+}
+
+static const char usage[] = "Usage: %s"
+#ifdef SAMPLE
+   " [-S samplefile]"
+#endif
+#ifdef TRACE
+   " [-r tracefile | -R tracefile [-s instruction]]"
+#endif
+#ifdef AOT
+   " [-o outfile.c]"
+#endif
+   " [-i instructions] [-t seconds] [-c cells] [-m megabytes]"
+   " [-j jobs] <srcfile> [inputfile...]\n";
+
+static const char options[] = ""
+#ifdef SAMPLE
+   "S:"
+#endif
+#ifdef TRACE
+   "r:R:s:"
+#endif
+#ifdef AOT
+   "o:"
+#endif
+   "i:t:c:m:j:";
+
 int main(int argc, char **argv) {
-   if (argc != 2) {
-      fprintf(stderr, "Usage: %s <srcfile>\n", argv[0]);
+#ifdef TRACE
+   const char *record_path = NULL, *replay_path = NULL;
+   uintmax_t seek = UINTMAX_MAX;
+#endif
+#ifdef AOT
+   const char *aot_path = NULL;
+#endif
+   uintmax_t jobs = 1;
+   int opt;
+   while ((opt = getopt(argc, argv, options)) != -1) {
+      switch (opt) {
+#ifdef SAMPLE
+      case 'S': sample_path = optarg; break;
+#endif
+#ifdef TRACE
+      case 'r': record_path = optarg; break;
+      case 'R': replay_path = optarg; break;
+      case 's':
+         if (!parse_number(optarg, &seek) || seek == UINTMAX_MAX)
+            goto bad_number;
+         break;
+#endif
+#ifdef AOT
+      case 'o': aot_path = optarg; break;
+#endif
+      case 'i':
+         if (!parse_number(optarg, &limit_instructions))
+            goto bad_number;
+         break;
+      case 'c':
+         if (!parse_number(optarg, &limit_cells))
+            goto bad_number;
+         break;
+      case 'j':
+         if (!parse_number(optarg, &jobs) || !jobs)
+            goto bad_number;
+         break;
+      case 'm':
+         if (!parse_number(optarg, &limit_kbytes)
+          || limit_kbytes > UINTMAX_MAX / 1024)
+            goto bad_number;
+         limit_kbytes *= 1024;
+         break;
+      case 't': {
+         char *end;
+         errno = 0;
+         limit_seconds = strtod(optarg, &end);
+         if (!*optarg || *end || errno || !(limit_seconds >= 0)
+          || limit_seconds > (double)INT32_MAX)
+            goto bad_number;
+         break;
+      }
+bad_number:
+         fprintf(stderr, "%s: invalid number '%s' for -%c\n",
+                 argv[0], optarg, opt);
+         return 3;
+      default:
+         fprintf(stderr, usage, argv[0]);
+         return 3;
+      }
+   }
+   // Runs over input files can't share one sample file or trace.
+   const size_t ninputs = argc - optind - (optind < argc);
+   if (argc - optind < 1
+#ifdef SAMPLE
+    || (sample_path && ninputs)
+#endif
+#ifdef TRACE
+    || (record_path && replay_path) || (seek != UINTMAX_MAX && !replay_path)
+    || ((record_path || replay_path) && ninputs)
+#endif
+#ifdef AOT
+    || (aot_path && ninputs)
+#endif
+   ) {
+      fprintf(stderr, usage, argv[0]);
       return 3;
    }
-   const int code_fd = open(argv[1], O_RDONLY);
+   const char *code_path = argv[optind];
+
+   const int code_fd = open(code_path, O_RDONLY);
    if (code_fd == -1)
       return fail(argv[0], "open");
 
@@ -105,55 +1030,257 @@ int main(int argc, char **argv) {
    close(code_fd);
 
    offset = MUSHCOORDS2(0,0);
+   delta  = MUSHCOORDS2(1,0);
+   cc_buf = cc_init(0);
 
+   mushcoords2 pos = offset;
    space = mushspace2_init(NULL, NULL);
+
+#ifdef TRACE
+   TraceState state;
+   bool restored = false;
+   if (record_path) {
+      if (!trace_record_start(argv[0], record_path, code, code_len))
+         return fail(argv[0], "trace_record_start");
+      tracing = true;
+   }
+   if (replay_path) {
+      if (!trace_replay_start(argv[0], replay_path, code, code_len, seek,
+                              &state, &restored))
+         return fail(argv[0], "trace_replay_start");
+      tracing = true;
+
+      // When seeking, it's the state at the end that's of interest, and
+      // starting from a checkpoint would only show part of the output anyway.
+      if (seek != UINTMAX_MAX && !freopen("/dev/null", "w", stdout))
+         return fail(argv[0], "freopen");
+   }
+   if (restored)
+      pos = trace_set_state(&state);
+   else
+#endif
    mushspace2_load_string(space, code, code_len, NULL, offset, false);
    munmap(code, code_len);
 
-   cursor      = mushcursor2_init(NULL, space, offset);
+   cursor      = mushcursor2_init(NULL, space, pos);
    strn_cursor = mushcursor2_init(NULL, space, offset);
 
-   delta = MUSHCOORDS2(1,0);
+#ifdef AOT
+   // Programs that can't be compiled are interpreted instead.
+   if (aot_path) {
+      switch (aot_compile(argv[0], space, aot_path)) {
+      case AOT_COMPILED:    return 0;
+      case AOT_ERROR:       return fail(argv[0], aot_path);
+      case AOT_UNSUPPORTED: break;
+      }
+   }
+#endif
 
-   cc_buf = cc_init(0);
+   if (ninputs) {
+      int status;
+      if (fork_runs(argv[0], argv + optind + 1, ninputs, jobs, &status))
+         return status;
+   }
 
    jmp_buf jmp;
+   infloop_jmp = &jmp;
+   mushspace2_set_handler(space, handler, &jmp);
+
+#ifdef SAMPLE
+   if (sample_path && !sample_start(sample_path, sample_state))
+      return fail(argv[0], "sample_start");
+#endif
+
+#ifdef PROFILE
+   mushbounds2 bounds;
+   mushspace2_get_loose_bounds(space, &bounds);
+   profile_init(bounds);
+#endif
+
+#ifdef JIT
+#ifdef TRACE
+   jit_enabled = jit_enabled && !tracing;
+#endif
+#ifdef STATS
+   uintmax_t *jit_instructions = &instructions;
+#else
+   uintmax_t *jit_instructions = NULL;
+#endif
+   jit_init(&(JitHooks){
+      .get = get_offset, .put = put_offset,
+      .print_number = print_number, .print_char = print_char,
+      .bounds = loose_bounds,
+      .budget_slice = &budget_slice, .instructions = jit_instructions,
+      .tainted = &tainted,
+   });
+#endif
+
+#ifdef LINE_CACHE
+   line_cache_init(&line_cache, space_get_uncached);
+#endif
+
+   budget_start();
+
    if (setjmp(jmp)) {
+#ifdef PUTBUF
+      // The cursor may have found only spaces because whatever would have
+      // stopped it is still in the buffer: if so, look again.
+      if (putbuf_len) {
+         putbuf_flush(space);
+         set_pos(fetch_from);
+         goto run;
+      }
+#endif
       mushcoords2 pos = mushcursor2_get_pos(cursor);
       fprintf(stderr, "%s: cursor infloops at ( %ld %ld )\n",
-              argv[0], pos.x, pos.y);
+              argv[0], (long)pos.x, (long)pos.y);
+      report(argv[0]);
       return 1;
    }
-
-   mushspace2_set_handler(space, handler, &jmp);
-
+#ifdef PUTBUF
+run:
+#endif
    for (;;) {
+      if (!--budget_slice && over_budget())
+         break;
+#ifdef TRACE
+      if (trace_stop_due() && trace_stop(argv[0]))
+         break;
+#endif
+#ifdef STATS
+      ++instructions;
+#endif
+#ifdef PROFILE
+      const bool timed = profile_timing();
+      uint64_t ticks = timed ? profile_ticks() : 0;
+#endif
       cell c;
+#ifdef PUTBUF
+      fetch_from = mushcursor2_get_pos(cursor);
+#endif
       if (stringmode) {
-         mushcursor2_skip_to_last_space(cursor, delta, &c);
+         c = fetch_string();
+#ifdef TRACE
+         if (tracing)
+            trace_pos(mushcursor2_get_pos(cursor));
+#endif
+         tainted = true;
          if (c == '"')
             stringmode = false;
+         else if (bulk_strings())
+            push_string_run(c);
          else
             cc_push(cc, c);
-         mushcursor2_advance(cursor, delta);
+#ifdef JIT
+         if (jit_recording) {
+            const mushcoords2 at = mushcursor2_get_pos(cursor);
+            jit_record(&(JitStep){
+               .pos = at, .delta = delta, .c = c, .string = true,
+               .after = at, .next = delta, .value = c,
+            });
+         }
+#endif
+         advance(delta);
+#ifdef PROFILE
+         if (timed)
+            profile_time(PROFILE_STRINGMODE, profile_ticks() - ticks);
+#endif
          continue;
       }
 
+#ifdef LINE_CACHE
+      if ((line_cache_get(&line_cache, &c) && c != ' ' && c != ';')
+       || skip_cached(&c))
+         goto fetched;
+#endif
       mushcursor2_skip_markers(cursor, delta, &c);
+#ifdef PUTBUF
+      if (putbuf_crossed(fetch_from, mushcursor2_get_pos(cursor), delta)) {
+         putbuf_flush(space);
+         set_pos(fetch_from);
+         mushcursor2_skip_markers(cursor, delta, &c);
+      }
+#endif
+#ifdef LINE_CACHE
+      line_cache_seek(&line_cache, mushcursor2_get_pos(cursor), delta, c);
+fetched:
+#endif
+#ifdef TRACE
+      if (tracing)
+         trace_pos(mushcursor2_get_pos(cursor));
+#endif
+
+#ifdef PROFILE
+      if (timed)
+         profile_time(PROFILE_SKIP, profile_ticks() - ticks);
+      profile_instruction(mushcursor2_get_pos(cursor), c,
+                          stackstack ? stack_stack_size(stackstack) : 1);
+      if (timed)
+         ticks = profile_ticks();
+#endif
+
+#ifdef JIT
+      JitStep step;
+      if (jit_enabled) {
+         step.pos = mushcursor2_get_pos(cursor);
+         if (!jit_recording && jit_may_enter(c)
+          && jit_enter(step.pos, &delta, cc, &step.after))
+         {
+            set_pos(step.after);
+            advance(delta);
+            continue;
+         }
+         step.delta  = delta;
+         step.c      = c;
+         step.string = false;
+      }
+#endif
+
+      tainted |= !is_pure(c);
+      int ret = execute(c);
+
+#ifdef JIT
+      if (jit_recording) {
+         step.after = mushcursor2_get_pos(cursor);
+         step.next  = delta;
+         step.value = c == '\'' ? cc_top(cc) : 0;
+         jit_record(&step);
+      }
+#endif
 
-      switch (execute(c)) {
+#ifdef PROFILE
+      if (timed)
+         profile_time(PROFILE_EXECUTE, profile_ticks() - ticks);
+#endif
+
+      switch (ret) {
       case 0: break;
-      case 1: mushcursor2_advance(cursor, delta);
+      case 1: advance(delta);
       case 2: continue;
       }
       break;
    }
+   if (exhausted) {
+      mushcoords2 pos = mushcursor2_get_pos(cursor);
+      fprintf(stderr, "%s: %s budget exhausted at ( %ld %ld )\n",
+              argv[0], exhausted, (long)pos.x, (long)pos.y);
+   }
+   if (infloop) {
+      mushcoords2 pos = mushcursor2_get_pos(cursor);
+      fprintf(stderr, "%s: cursor infloops at ( %ld %ld )\n",
+              argv[0], (long)pos.x, (long)pos.y);
+   }
+   report(argv[0]);
 #ifdef FREE_ON_EXIT
    mushcursor2_free(strn_cursor); free(strn_cursor);
    mushcursor2_free(cursor); free(cursor);
    mushspace2_free(space); free(space);
    cc_free(cc);
+#ifdef JIT
+   jit_free();
+#endif
 #endif
+   return exhausted || infloop ? 1 : 0;
 }
 
 static int execute(mushcell i) {
@@ -186,7 +1313,7 @@ turn_left:
       break;
 
    case '#':
-      mushcursor2_advance(cursor, delta);
+      advance(delta);
       break;
 
    case '@': return 0;
@@ -199,24 +1326,28 @@ turn_left:
       mushcoords2 jump;
       jump.x = mushcell_mul(delta.x, n);
       jump.y = mushcell_mul(delta.y, n);
-      mushcursor2_advance(cursor, jump);
+      advance(jump);
       break;
    }
 
    case 'k': {
       cell n = cc_pop(cc);
       mushcoords2 pos = mushcursor2_get_pos(cursor);
-      mushcursor2_advance(cursor, delta);
+      advance(delta);
       if (n <= 0)
          break;
       cell i;
+      space_sync();
       mushcursor2_skip_markers(cursor, delta, &i);
-      mushcursor2_set_pos(cursor, pos);
+      set_pos(pos);
       int ret = execute(i);
       if (!ret)
          return 0;
-      while (--n)
+      while (--n) {
+         if (!--budget_slice && over_budget())
+            return 0;
          execute(i);
+      }
       return ret;
    }
 
@@ -281,12 +1412,15 @@ turn_left:
    case '"': stringmode = true; break;
 
    case '\'':
-      mushcursor2_advance(cursor, delta);
+      advance(delta);
+      space_sync_at(mushcursor2_get_pos(cursor));
       cc_push(cc, mushcursor2_get(cursor));
       break;
    case 's':
-      mushcursor2_advance(cursor, delta);
+      advance(delta);
+      space_sync_at(mushcursor2_get_pos(cursor));
       mushcursor2_put(cursor, cc_pop(cc));
+      space_wrote(mushcursor2_get_pos(cursor));
       break;
 
    case '$': cc_popN(cc, 1); break;
@@ -319,21 +1453,18 @@ turn_left:
       stack_stack_push(stackstack, toss);
       CellContainer *soss = cc;
       cell n = cc_pop(soss);
+      if (!budget_grow(n < 0 ? -(uintmax_t)n : (uintmax_t)n))
+         return 0;
       if (n > 0) {
-         block_transfer_p = cc_reserve(toss, n);
-         cc_mapFirstN(soss, n, block_transfer_f, block_transfer_g);
-         cc_popN(soss, n);
-      } else if (n < 0) {
-         // FIXME -cell_min < 0
-         n = -n;
-         cell *p = cc_reserve(soss, n);
-         while (n--)
-            *p++ = 0;
-      }
+         const size_t have = underflow_zeros(toss, soss, n);
+         copy_top(cc_reserve(toss, have), soss, have, false);
+         cc_popN(soss, have);
+      } else if (n < 0)
+         cc_pushZeros(soss, clamp_size(-(ucell)n));
       cc_push(cc, offset.x);
       cc_push(cc, offset.y);
       cc = toss;
-      mushcursor2_advance(cursor, delta);
+      advance(delta);
       offset = mushcursor2_get_pos(cursor);
       return 2;
    }
@@ -346,19 +1477,12 @@ turn_left:
       offset.y = cc_pop(cc);
       offset.x = cc_pop(cc);
       if (n > 0) {
-         block_transfer_p = cc_reserve(cc, n);
-         cc_mapFirstN(old, n, block_transfer_f, block_transfer_g);
-      } else if (n < 0) {
-         if (n == MUSHCELL_MIN) {
-            if ((uintmax_t)SIZE_MAX > (uintmax_t)MUSHCELL_MAX)
-               cc_popN(cc, (size_t)MUSHCELL_MAX + 1);
-            else {
-               cc_popN(cc, MUSHCELL_MAX);
-               cc_popN(cc, 1);
-            }
-         } else
-            cc_popN(cc, -n);
-      }
+         if (!budget_grow(n))
+            return 0;
+         const size_t have = underflow_zeros(cc, old, n);
+         copy_top(cc_reserve(cc, have), old, have, false);
+      } else if (n < 0)
+         cc_popN(cc, clamp_size(-(ucell)n));
       cc_free(old);
       free(old);
       break;
@@ -382,9 +1506,16 @@ turn_left:
       } else
          break;
 
-      block_transfer_p = cc_reserve(tgt, n) + n - 1;
-      cc_mapFirstN(src, n, stack_under_stack_f, stack_under_stack_g);
-      cc_popN(src, n);
+      if (!budget_grow(n))
+         return 0;
+
+      // The cells go in reversed, so the zeros for any missing ones go on
+      // top of them.
+      const size_t size = cc_size(src),
+                   have = (ucell)n < size ? (size_t)n : size;
+      copy_top(cc_reserve(tgt, have), src, have, true);
+      cc_popN(src, have);
+      cc_pushZeros(tgt, clamp_size((ucell)n - have));
       break;
    }
 
@@ -392,73 +1523,26 @@ turn_left:
       mushcoords2 vec;
       vec.y = cc_pop(cc) + offset.y;
       vec.x = cc_pop(cc) + offset.x;
-      cc_push(cc, mushspace2_get(space, vec));
+      cc_push(cc, space_get(vec));
       break;
    }
    case 'p': {
       mushcoords2 vec;
       vec.y = cc_pop(cc) + offset.y;
       vec.x = cc_pop(cc) + offset.x;
-      mushspace2_put(space, vec, cc_pop(cc));
+      space_put(vec, cc_pop(cc));
       break;
    }
 
-   case '.': printf("%ld ", cc_pop(cc)); break;
-   case ',': {
-      char c = (char)cc_pop(cc);
-      putchar_unlocked(c);
-      if (c == '\n')
-         fflush(stdout);
-      break;
-   }
+   case '.': print_number(cc_pop(cc)); break;
+   case ',': print_char  (cc_pop(cc)); break;
 
-   case '&': {
-      int i;
-      unsigned char c;
-      fflush(stdout);
-      do {
-         if ((i = getchar_unlocked()) == EOF)
-            goto reverse;
-         c = i;
-      } while (c < '0' || c > '9');
-      ungetc(c, stdin);
-
-      cell n = 0;
-      char s[21];
-      uint8_t j = 0;
-
-      errno = 0;
-      while (j < 20) {
-         if ((i = getchar_unlocked()) == EOF)
-            break;
-
-         c = i;
-         if (c < '0' || c > '9')
-            break;
-
-         s[j++] = c;
-         s[j]   = 0;
-         cell tmp = strtol(s, NULL, 10);
-         if (errno)
-            break;
-         n = tmp;
-      }
-      if (i != EOF)
-         ungetc(c, stdin);
-      cc_push(cc, n);
-      break;
-   }
+   case '&':
    case '~': {
-      int i;
-      unsigned char c;
+      cell c;
       fflush(stdout);
-      if ((i = getchar_unlocked()) == EOF)
+      if (!input(i == '&' ? read_number : read_char, &c))
          goto reverse;
-      if ((c = i) == '\r') {
-         if ((i = getchar_unlocked()) != '\n')
-            ungetc(i, stdin);
-         c = '\n';
-      }
       cc_push(cc, c);
       break;
    }
@@ -472,6 +1556,34 @@ turn_left:
       break;
    }
 
+   case 'i': {
+      const char_arr path = pop_string(cc, &strn_buf);
+      const cell flags = cc_pop(cc);
+      mushcoords2 vec, size;
+      vec.y = cc_pop(cc);
+      vec.x = cc_pop(cc);
+      const mushcoords2 at = MUSHCOORDS2(vec.x + offset.x, vec.y + offset.y);
+      if (!files_allowed() || !input_file(path.ptr, flags & 1, at, &size))
+         goto reverse;
+      cc_push(cc, size.x);
+      cc_push(cc, size.y);
+      cc_push(cc, vec.x);
+      cc_push(cc, vec.y);
+      break;
+   }
+   case 'o': {
+      const char_arr path = pop_string(cc, &strn_buf);
+      const cell flags = cc_pop(cc);
+      mushcoords2 vec, size;
+      vec.y  = cc_pop(cc) + offset.y;
+      vec.x  = cc_pop(cc) + offset.x;
+      size.y = cc_pop(cc);
+      size.x = cc_pop(cc);
+      if (!files_allowed() || !output_file(path.ptr, flags & 1, vec, size))
+         goto reverse;
+      break;
+   }
+
    case '(': {
       cell n = cc_pop(cc);
       if (n <= 0)
@@ -520,6 +1632,7 @@ turn_left:
       vec.y = cc_pop(cc) + offset.y;
       vec.x = cc_pop(cc) + offset.x;
       size_t i = 0;
+      space_sync();
       mushcursor2_set_pos(strn_cursor, vec);
       for (;;) {
          char c = (char)mushcursor2_get(strn_cursor);
@@ -535,9 +1648,7 @@ turn_left:
    case 'N':
       if (!strn_enabled)
          goto reverse;
-      cells_length_n = 0;
-      cc_foreachTopToBottom(cc, cells_length);
-      cc_push(cc, cells_length_n - 1);
+      cc_push(cc, (cell)string_length(cc) - 1);
       break;
    case 'P': {
       if (!strn_enabled)
@@ -545,10 +1656,12 @@ turn_left:
       mushcoords2 vec;
       vec.y = cc_pop(cc) + offset.y;
       vec.x = cc_pop(cc) + offset.x;
+      space_sync();
       mushcursor2_set_pos(strn_cursor, vec);
-      cells_length_n = 0;
-      cc_foreachTopToBottom(cc, strn_put_foreach);
-      cc_popN(cc, cells_length_n);
+      const size_t n = string_put(cc);
+      cc_popN(cc, n);
+      for (size_t i = 0; i < n; ++i)
+         space_wrote(MUSHCOORDS2(vec.x + (cell)i, vec.y));
       break;
    }
 
@@ -558,21 +1671,174 @@ reverse:
    return 1;
 }
 
-static void block_transfer_f(cell* a, size_t n) {
-   memcpy(block_transfer_p, a, n * sizeof *a);
-   block_transfer_p += n;
+// The limits are for running untrusted code, so such code may not touch files.
+static bool files_allowed(void) {
+   return !limit_instructions && !limit_cells && !limit_kbytes
+       && !limit_seconds;
+}
+
+// With TRACE, logs the file read by i, or checks it against the log. Returns
+// ok.
+static bool traced_file(bool ok, const unsigned char *data, size_t len) {
+#ifdef TRACE
+   if (tracing)
+      trace_file(ok, data, len);
+#else
+   (void)data; (void)len;
+#endif
+   return ok;
+}
+
+// Loads the file at path into Funge-space at pos, like the program itself but
+// with binary leaving newlines and form feeds as they are. Puts the size of
+// the area it covers in *size. When replaying a trace, the file is read again,
+// and the replay stops if it's changed.
+static bool input_file(
+   const char *path, bool binary, mushcoords2 pos, mushcoords2 *size)
+{
+   const int fd = open(path, O_RDONLY);
+   if (fd == -1)
+      return traced_file(false, NULL, 0);
+
+   struct stat st;
+   if (fstat(fd, &st) == -1
+    || (sizeof(off_t) >  sizeof(size_t) && st.st_size > (off_t)SIZE_MAX)
+    || (sizeof(off_t) == sizeof(size_t) && st.st_size > PTRDIFF_MAX))
+   {
+      close(fd);
+      return traced_file(false, NULL, 0);
+   }
+   const size_t len = st.st_size;
+
+   *size = MUSHCOORDS2(0,0);
+   if (!len) {
+      close(fd);
+      return traced_file(true, NULL, 0);
+   }
+
+   // Mapping it saves copying it into a buffer only for mushspace to copy it
+   // again: even a large file is read just once, straight from the page cache.
+   unsigned char *data = mmap(0, len, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED)
+      return traced_file(false, NULL, 0);
+   traced_file(true, data, len);
+
+   space_sync();
+   mushcoords2 end;
+   const int err = mushspace2_load_string(space, data, len, &end, pos, binary);
+   munmap(data, len);
+   space_wrote_all();
+   if (err)
+      return false;
+
+   *size = MUSHCOORDS2(end.x - pos.x + 1, end.y - pos.y + 1);
+   return true;
+}
+
+// Writes the size.x by size.y area at pos in Funge-space to the file at path,
+// a row per line. If text, without the spaces at the end of each line and the
+// empty lines at the end of the file.
+static bool output_file(
+   const char *path, bool text, mushcoords2 pos, mushcoords2 size)
+{
+   const size_t width = clamp_size((ucell)size.x);
+   if (size.x < 0 || size.y < 0 || width == SIZE_MAX)
+      return false;
+
+   char *row = malloc(width + 1);
+   if (!row)
+      return false;
+   FILE *file = fopen(path, "wb");
+   if (!file) {
+      free(row);
+      return false;
+   }
+
+   space_sync();
+
+   // Empty lines not yet written, in case nothing else follows them.
+   cell blank = 0;
+   for (cell y = 0; y < size.y; ++y) {
+      size_t n = 0, len = 0;
+      for (cell x = 0; x < size.x; ++x) {
+         const cell c =
+            mushspace2_get(space, MUSHCOORDS2(pos.x + x, pos.y + y));
+         row[n++] = (char)c;
+         if (!text || c != ' ')
+            len = n;
+      }
+      if (!len && text) {
+         ++blank;
+         continue;
+      }
+      for (; blank; --blank)
+         putc('\n', file);
+      row[len++] = '\n';
+      fwrite(row, 1, len, file);
+   }
+   free(row);
+
+   const bool ok = !ferror(file);
+   return fclose(file) == 0 && ok;
 }
-static void block_transfer_g(size_t n) {
-   while (n--)
-      *block_transfer_p++ = 0;
+
+// Copies the n cells that src, which has at least that many, would pop first
+// to dst. If reverse, in the opposite order, as u wants.
+static inline void copy_top(
+   cell *dst, CellContainer *src, size_t n, bool reverse)
+{
+   CellSpans it;
+   cc_spansFirst(&it, src);
+#ifdef MODE
+   if (it.up) {
+      // A Deque in queuemode: its cells go in memory order, as with a Stack.
+      cell *end = dst + n;
+      for (CellSpan s; n && cc_spansNext(&it, &s);) {
+         const size_t k = s.len < n ? s.len : n;
+         n -= k;
+         if (reverse)
+            for (size_t i = 0; i < k; ++i)
+               *--end = s.ptr[i];
+         else {
+            memcpy(dst, s.ptr, k * sizeof *s.ptr);
+            dst += k;
+         }
+      }
+      return;
+   }
+#endif
+   for (CellSpan s; n && cc_spansNext(&it, &s);) {
+      const size_t k = s.len < n ? s.len : n;
+      const cell *top = s.ptr + s.len - k;
+      n -= k;
+      if (reverse)
+         for (size_t i = k; i--;)
+            *dst++ = top[i];
+      else
+         memcpy(dst + n, top, k * sizeof *top);
+   }
 }
-static void stack_under_stack_f(cell* a, size_t n) {
-   while (n--)
-      *block_transfer_p-- = *a++;
+
+// For moving the top n cells of src onto tgt: pushes the zeros that stand in
+// for any cells src is short of, and returns how many it does have.
+static size_t underflow_zeros(
+   CellContainer *tgt, CellContainer *src, cell n)
+{
+   const size_t have = cc_size(src);
+   if ((ucell)n <= have)
+      return (size_t)n;
+   cc_pushZeros(tgt, clamp_size((ucell)n - have));
+   return have;
 }
-static void stack_under_stack_g(size_t n) {
-   while (n--)
-      *block_transfer_p-- = 0;
+
+// More than SIZE_MAX cells is as good as SIZE_MAX.
+static size_t clamp_size(ucell n) {
+#if CELL_BITS > 64
+   return n > SIZE_MAX ? SIZE_MAX : (size_t)n;
+#else
+   return n;
+#endif
 }
 
 static void char_arr_push(char_arr *buf, size_t i, char c) {
@@ -596,13 +1862,34 @@ static void push_string(CellContainer *cc, char_arr arr) {
       *p++ = arr.ptr[i];
 }
 
-static int strn_put_foreach(cell *c) {
-   mushcursor2_put    (strn_cursor, *c);
-   mushcursor2_advance(strn_cursor, MUSHCOORDS2(1,0));
-   ++cells_length_n;
-   return *c != 0;
+// The number of cells from the top of cc down to its first zero, inclusive,
+// or all of them if there isn't one.
+static size_t string_length(CellContainer *cc) {
+   size_t n = 0;
+   CellSpans it;
+   cc_spansFromTop(&it, cc);
+   for (CellSpan s; cc_spansNext(&it, &s);)
+      for (size_t i = s.len; i--;) {
+         ++n;
+         if (!s.ptr[i])
+            return n;
+      }
+   return n;
 }
-static int cells_length(cell *c) {
-   ++cells_length_n;
-   return *c != 0;
+
+// Writes the string_length(cc) cells on top of cc to the right of
+// strn_cursor, top first, returning how many there were.
+static size_t string_put(CellContainer *cc) {
+   size_t n = 0;
+   CellSpans it;
+   cc_spansFromTop(&it, cc);
+   for (CellSpan s; cc_spansNext(&it, &s);)
+      for (size_t i = s.len; i--;) {
+         mushcursor2_put    (strn_cursor, s.ptr[i]);
+         mushcursor2_advance(strn_cursor, MUSHCOORDS2(1,0));
+         ++n;
+         if (!s.ptr[i])
+            return n;
+      }
+   return n;
 }
@@ -0,0 +1,267 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 14:02:18
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "profile.h"
+
+// Execution counts per cell. Nearly all execution happens within the
+// program as loaded, so the counts for that area are kept in a plain array;
+// anything outside it goes into an open addressing hash table keyed by
+// position, since Funge-space is unbounded.
+typedef struct {
+   mushcoords2 pos;
+   cell        i;
+   uint64_t    count;
+} CellCount;
+
+static CellCount *dense = NULL;
+static mushcoords2 dense_beg;
+static uint64_t dense_w = 0, dense_h = 0;
+
+static CellCount *cells = NULL;
+static size_t cells_cap = 0, cells_len = 0;
+
+// Execution counts per instruction. Everything outside [0,256) is lumped
+// together in the last slot.
+static uint64_t instructions[257];
+
+// Stack stack depths by powers of two: depths_hist[i] counts depths in
+// [2^i, 2^(i+1)).
+static uint64_t depths_hist[sizeof(size_t) * 8];
+
+static uint64_t timers[PROFILE_TIMERS];
+
+unsigned profile_countdown = PROFILE_TIME_PERIOD;
+
+unsigned profile_next_countdown(void) {
+   static uint32_t lcg = 1;
+   lcg = lcg * 1664525 + 1013904223;
+   return PROFILE_TIME_PERIOD / 2 + (lcg >> 16) % PROFILE_TIME_PERIOD;
+}
+
+static size_t hash(mushcoords2 pos) {
+   uint64_t h = (uint64_t)pos.x * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)pos.y * 0xc2b2ae3d27d4eb4fu;
+   return h ^ (h >> 29);
+}
+
+static CellCount *find(CellCount *tab, size_t cap, mushcoords2 pos) {
+   for (size_t i = hash(pos) & (cap - 1);; i = (i + 1) & (cap - 1))
+      if (!tab[i].count || (tab[i].pos.x == pos.x && tab[i].pos.y == pos.y))
+         return &tab[i];
+}
+
+static void grow(void) {
+   size_t cap = cells_cap ? 2 * cells_cap : 1024;
+   CellCount *tab = calloc(cap, sizeof *tab);
+   for (size_t i = 0; i < cells_cap; ++i)
+      if (cells[i].count)
+         *find(tab, cap, cells[i].pos) = cells[i];
+   free(cells);
+   cells     = tab;
+   cells_cap = cap;
+}
+
+void profile_init(mushbounds2 bounds) {
+   // Don't bother if the program is too large for it to be worth it.
+   enum { MAX_DENSE = 1 << 20 };
+
+   uint64_t w = (uint64_t)bounds.end.x - bounds.beg.x + 1,
+            h = (uint64_t)bounds.end.y - bounds.beg.y + 1;
+   if (bounds.end.x < bounds.beg.x || bounds.end.y < bounds.beg.y
+    || w > MAX_DENSE || h > MAX_DENSE / w)
+      return;
+
+   dense     = calloc(w * h, sizeof *dense);
+   dense_beg = bounds.beg;
+   dense_w   = w;
+   dense_h   = h;
+}
+
+void profile_instruction(mushcoords2 pos, cell i, size_t depth) {
+   ++instructions[i >= 0 && i < 256 ? i : 256];
+
+   size_t bucket = 0;
+   while (depth >>= 1)
+      ++bucket;
+   ++depths_hist[bucket];
+
+   CellCount *c;
+   uint64_t dx = (uint64_t)pos.x - dense_beg.x,
+            dy = (uint64_t)pos.y - dense_beg.y;
+   if (dx < dense_w && dy < dense_h)
+      c = &dense[dy * dense_w + dx];
+   else {
+      if (2 * (cells_len + 1) > cells_cap)
+         grow();
+      c = find(cells, cells_cap, pos);
+   }
+   if (!c->count++) {
+      c->pos = pos;
+      ++cells_len;
+   }
+   // Self-modifying code may execute different instructions at the same
+   // position: remember the latest one.
+   c->i = i;
+}
+
+void profile_time(int timer, uint64_t ticks) { timers[timer] += ticks; }
+
+static int cmp_counts(const void *a, const void *b) {
+   uint64_t x = ((const CellCount*)a)->count, y = ((const CellCount*)b)->count;
+   return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void print_instruction(FILE *f, cell i) {
+   if (i > ' ' && i < 127)
+      fprintf(f, "'%c'", (char)i);
+   else
+      fprintf(f, "%3ld", (long)i);
+}
+
+static void report_heatmap(FILE *f, const CellCount *sorted, size_t n) {
+   enum { MAX_WIDTH = 78, MAX_HEIGHT = 40 };
+   static const char shades[] = " .:-=+*#%@";
+
+   mushcoords2 beg = sorted[0].pos, end = sorted[0].pos;
+   for (size_t i = 1; i < n; ++i) {
+      mushcoords2 p = sorted[i].pos;
+      if (p.x < beg.x) beg.x = p.x;
+      if (p.y < beg.y) beg.y = p.y;
+      if (p.x > end.x) end.x = p.x;
+      if (p.y > end.y) end.y = p.y;
+   }
+
+   // Each character of the heatmap covers a sx by sy rectangle of cells.
+   uint64_t w = (uint64_t)end.x - beg.x + 1,
+            h = (uint64_t)end.y - beg.y + 1,
+            sx = (w + MAX_WIDTH  - 1) / MAX_WIDTH,
+            sy = (h + MAX_HEIGHT - 1) / MAX_HEIGHT;
+   size_t gw = (w + sx - 1) / sx, gh = (h + sy - 1) / sy;
+
+   uint64_t *grid = calloc(gw * gh, sizeof *grid), max = 0;
+   for (size_t i = 0; i < n; ++i) {
+      size_t gx = ((uint64_t)sorted[i].pos.x - beg.x) / sx,
+             gy = ((uint64_t)sorted[i].pos.y - beg.y) / sy;
+      uint64_t *g = &grid[gy * gw + gx];
+      if ((*g += sorted[i].count) > max)
+         max = *g;
+   }
+
+   // Shade logarithmically: a hot loop typically runs orders of magnitude
+   // more often than its setup code.
+   unsigned max_log = 0;
+   while (max >> max_log)
+      ++max_log;
+
+   fprintf(f, "Heatmap of ( %ld %ld ) to ( %ld %ld ), %ju x %ju cells per "
+              "character:\n",
+           (long)beg.x, (long)beg.y, (long)end.x, (long)end.y,
+           (uintmax_t)sx, (uintmax_t)sy);
+   for (size_t y = 0; y < gh; ++y) {
+      fputc('|', f);
+      for (size_t x = 0; x < gw; ++x) {
+         uint64_t c = grid[y * gw + x];
+         unsigned lg = 0;
+         while (c >> lg)
+            ++lg;
+         size_t shade =
+            c ? 1 + (lg * (sizeof shades - 2) - 1) / max_log : 0;
+         fputc(shades[shade], f);
+      }
+      fputs("|\n", f);
+   }
+   free(grid);
+}
+
+void profile_report(FILE *f, const char *arg0) {
+   uint64_t total = 0;
+   for (size_t i = 0; i < 257; ++i)
+      total += instructions[i];
+
+   fprintf(f, "%s: profile: %ju instructions at %zu distinct cells\n",
+           arg0, (uintmax_t)total, cells_len);
+   if (!total)
+      return;
+
+   uint64_t ticks = 0;
+   for (int t = 0; t < PROFILE_TIMERS; ++t)
+      ticks += timers[t];
+   static const char *const timer_names[] = {
+      [PROFILE_SKIP]       = "skip_markers",
+      [PROFILE_EXECUTE]    = "execute",
+      [PROFILE_STRINGMODE] = "stringmode",
+   };
+   fputs("Time spent, in estimated ticks:\n", f);
+   for (int t = 0; t < PROFILE_TIMERS; ++t)
+      fprintf(f, "   %-14s %16ju %6.2f%%\n", timer_names[t],
+              (uintmax_t)timers[t] * PROFILE_TIME_PERIOD,
+              ticks ? 100.0 * timers[t] / ticks : 0.0);
+
+   // Sort the instructions by hotness.
+   CellCount by_insn[257];
+   size_t ninsns = 0;
+   for (size_t i = 0; i < 257; ++i)
+      if (instructions[i])
+         by_insn[ninsns++] = (CellCount){{0,0}, i, instructions[i]};
+   qsort(by_insn, ninsns, sizeof *by_insn, cmp_counts);
+
+   fputs("Hot instructions:\n", f);
+   for (size_t i = 0; i < ninsns; ++i) {
+      fputs("   ", f);
+      if (by_insn[i].i == 256)
+         fputs("(other)", f);
+      else
+         print_instruction(f, by_insn[i].i);
+      fprintf(f, " %16ju %6.2f%%\n", (uintmax_t)by_insn[i].count,
+              100.0 * by_insn[i].count / total);
+   }
+
+   // Gather all the counts into the cell table, compacting it in place, and
+   // sort it.
+   size_t n = 0;
+   for (size_t i = 0; i < cells_cap; ++i)
+      if (cells[i].count)
+         cells[n++] = cells[i];
+   cells = realloc(cells, cells_len * sizeof *cells);
+   for (size_t i = 0; i < dense_w * dense_h; ++i)
+      if (dense[i].count)
+         cells[n++] = dense[i];
+   qsort(cells, n, sizeof *cells, cmp_counts);
+
+   fputs("Hot cells:\n", f);
+   for (size_t i = 0; i < n && i < 20; ++i) {
+      fprintf(f, "   ( %ld %ld ) ",
+              (long)cells[i].pos.x, (long)cells[i].pos.y);
+      print_instruction(f, cells[i].i);
+      fprintf(f, " %16ju %6.2f%%\n", (uintmax_t)cells[i].count,
+              100.0 * cells[i].count / total);
+   }
+
+   fputs("Stack stack depth:\n", f);
+   for (size_t i = 0; i < sizeof depths_hist / sizeof *depths_hist; ++i) {
+      if (!depths_hist[i])
+         continue;
+      size_t lo = (size_t)1 << i, hi = 2 * lo - 1;
+      char range[64];
+      if (lo == hi)
+         snprintf(range, sizeof range, "%zu", lo);
+      else
+         snprintf(range, sizeof range, "%zu-%zu", lo, hi);
+      fprintf(f, "   %-14s %16ju %6.2f%%\n", range,
+              (uintmax_t)depths_hist[i], 100.0 * depths_hist[i] / total);
+   }
+
+   if (n)
+      report_heatmap(f, cells, n);
+
+   // The table is no longer a valid hash table.
+   free(cells);
+   free(dense);
+   cells = dense = NULL;
+   cells_cap = cells_len = 0;
+   dense_w = dense_h = 0;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 14:02:18
+
+// The instruction-level profiler enabled with -DPROFILE. main.c reports every
+// instruction it fetches along with how long fetching and executing it took,
+// and at exit a summary is printed: the hottest instructions and cells, the
+// time split, a histogram of stack stack depths, and a heatmap of the
+// executed part of Funge-space.
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+// A cheap timestamp: cycles where we can read them directly, nanoseconds
+// otherwise. Only differences between these are meaningful.
+#if defined(__x86_64__) || defined(__i386__)
+static inline uint64_t profile_ticks(void) { return __builtin_ia32_rdtsc(); }
+#else
+#include <time.h>
+static inline uint64_t profile_ticks(void) {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+enum { PROFILE_SKIP, PROFILE_EXECUTE, PROFILE_STRINGMODE, PROFILE_TIMERS };
+
+// Reading the clock can cost as much as executing an instruction, so only
+// about one instruction in PROFILE_TIME_PERIOD is timed, chosen at
+// pseudorandom intervals so that loops whose length divides the period don't
+// always get the same instructions timed. The timers are scaled back up when
+// reporting.
+enum { PROFILE_TIME_PERIOD = 64 };
+
+extern unsigned profile_countdown;
+unsigned profile_next_countdown(void);
+
+// Whether the current instruction should be timed.
+static inline bool profile_timing(void) {
+   if (--profile_countdown)
+      return false;
+   profile_countdown = profile_next_countdown();
+   return true;
+}
+
+// Should be called once the program has been loaded, with its bounds.
+void profile_init(mushbounds2);
+
+// Counts one execution of i at pos with the given number of stacks on the
+// stack stack.
+void profile_instruction(mushcoords2 pos, cell i, size_t depth);
+
+// Adds the given number of ticks, measured for an instruction for which
+// profile_timing() returned true, to one of the PROFILE_* timers.
+void profile_time(int timer, uint64_t ticks);
+
+void profile_report(FILE *, const char *arg0);
+
+#endif
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 17:05:31
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "putbuf.h"
+
+typedef struct {
+   mushcoords2 pos;
+   cell c;
+} Put;
+
+static Put buffered[PUTBUF_SIZE];
+
+size_t putbuf_len = 0;
+mushbounds2 putbuf_box;
+
+// An open addressing index into buffered, so that repeated writes to a cell
+// can be combined and g can find them. Holds indices plus one, zero meaning
+// an empty slot. Kept at most half full.
+enum { SLOTS = 2 * PUTBUF_SIZE };
+static uint32_t slots[SLOTS];
+
+static size_t hash(mushcoords2 pos) {
+   uint64_t h = (uint64_t)pos.x * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)pos.y * 0xc2b2ae3d27d4eb4fu;
+   return (h ^ h >> 29) % SLOTS;
+}
+
+static uint32_t *find(mushcoords2 pos) {
+   for (size_t i = hash(pos);; i = (i + 1) % SLOTS) {
+      const uint32_t j = slots[i];
+      if (!j)
+         return &slots[i];
+      const mushcoords2 p = buffered[j-1].pos;
+      if (p.x == pos.x && p.y == pos.y)
+         return &slots[i];
+   }
+}
+
+void putbuf_put(mushspace2 *space, mushcoords2 pos, cell c) {
+   uint32_t *slot = find(pos);
+   if (*slot) {
+      buffered[*slot - 1].c = c;
+      return;
+   }
+
+   // The bounds determine where cursors wrap around, so they must always be
+   // up to date: writes that may grow them go straight through.
+   mushbounds2 bounds;
+   mushspace2_get_loose_bounds(space, &bounds);
+   if (pos.x < bounds.beg.x || pos.x > bounds.end.x
+    || pos.y < bounds.beg.y || pos.y > bounds.end.y)
+   {
+      mushspace2_put(space, pos, c);
+      return;
+   }
+   if (putbuf_len == PUTBUF_SIZE) {
+      putbuf_flush(space);
+      slot = find(pos);
+   }
+
+   if (!putbuf_len)
+      putbuf_box.beg = putbuf_box.end = pos;
+   else {
+      if (pos.x < putbuf_box.beg.x) putbuf_box.beg.x = pos.x;
+      if (pos.x > putbuf_box.end.x) putbuf_box.end.x = pos.x;
+      if (pos.y < putbuf_box.beg.y) putbuf_box.beg.y = pos.y;
+      if (pos.y > putbuf_box.end.y) putbuf_box.end.y = pos.y;
+   }
+   buffered[putbuf_len++] = (Put){pos, c};
+   *slot = putbuf_len;
+}
+
+cell putbuf_get(mushspace2 *space, mushcoords2 pos) {
+   if (putbuf_holds(pos)) {
+      const uint32_t j = *find(pos);
+      if (j)
+         return buffered[j-1].c;
+   }
+   return mushspace2_get(space, pos);
+}
+
+static int cmp_puts(const void *va, const void *vb) {
+   const Put *a = va, *b = vb;
+   if (a->pos.y != b->pos.y)
+      return a->pos.y < b->pos.y ? -1 : 1;
+   if (a->pos.x != b->pos.x)
+      return a->pos.x < b->pos.x ? -1 : 1;
+   return 0;
+}
+
+void putbuf_flush(mushspace2 *space) {
+   if (!putbuf_len)
+      return;
+
+   // Row-major order lets mushspace extend its boxes one way at a time
+   // instead of zigzagging.
+   qsort(buffered, putbuf_len, sizeof *buffered, cmp_puts);
+   for (size_t i = 0; i < putbuf_len; ++i)
+      mushspace2_put(space, buffered[i].pos, buffered[i].c);
+
+   putbuf_len = 0;
+   memset(slots, 0, sizeof slots);
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 17:05:31
+
+// Write combining for p, enabled with -DPUTBUF. Programs that fill tables
+// with p spend most of their time in mushspace2_put, which may have to
+// recompute bounds or allocate a box on every call. Instead, puts are
+// collected here, repeated puts to the same cell overwriting each other, and
+// handed to mushspace in row-major order once PUTBUF_SIZE distinct cells have
+// been written. Only writes within Funge-space's current bounds are buffered,
+// since the bounds determine where cursors wrap around.
+//
+// Anything that reads Funge-space must see the buffered writes: g goes
+// through putbuf_get(), and everything else that reads or writes through a
+// cursor must flush the buffer first if it could touch a buffered cell. The
+// bounding box of the buffered cells makes that check cheap.
+
+#ifndef PUTBUF_H
+#define PUTBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+#ifndef PUTBUF_SIZE
+#define PUTBUF_SIZE 256
+#endif
+
+// The number of buffered cells, and their bounding box if there are any.
+extern size_t putbuf_len;
+extern mushbounds2 putbuf_box;
+
+void putbuf_put  (mushspace2 *, mushcoords2, cell);
+cell putbuf_get  (mushspace2 *, mushcoords2);
+void putbuf_flush(mushspace2 *);
+
+static inline bool putbuf_holds(mushcoords2 pos) {
+   return putbuf_len
+       && pos.x >= putbuf_box.beg.x && pos.x <= putbuf_box.end.x
+       && pos.y >= putbuf_box.beg.y && pos.y <= putbuf_box.end.y;
+}
+
+// Whether a cursor that moved from one position to another along delta,
+// reading the cells in between, may have read a buffered cell. Errs on the
+// side of true when the cursor wrapped around.
+static inline bool putbuf_crossed(
+   mushcoords2 from, mushcoords2 to, mushcoords2 delta)
+{
+   if (!putbuf_len)
+      return false;
+   if ((delta.x > 0 && to.x < from.x) || (delta.x < 0 && to.x > from.x)
+    || (delta.y > 0 && to.y < from.y) || (delta.y < 0 && to.y > from.y))
+      return true;
+   cell x0 = from.x < to.x ? from.x : to.x, x1 = from.x < to.x ? to.x : from.x,
+        y0 = from.y < to.y ? from.y : to.y, y1 = from.y < to.y ? to.y : from.y;
+   return x0 <= putbuf_box.end.x && x1 >= putbuf_box.beg.x
+       && y0 <= putbuf_box.end.y && y1 >= putbuf_box.beg.y;
+}
+
+#endif
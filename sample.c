@@ -0,0 +1,218 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 15:11:52
+
+#define _DEFAULT_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/time.h>
+
+#include "cell.h"
+#include "sample.h"
+
+#ifndef SAMPLE_HZ
+#define SAMPLE_HZ 997
+#endif
+
+// Everything the signal handlers touch is allocated up front: a fixed size
+// open addressing table of distinct samples and their counts. Should it fill
+// up, further distinct samples are merely counted.
+enum { TABLE_SIZE = 1 << 15 };
+
+typedef struct {
+   Sample s;
+   uintmax_t count;
+} Entry;
+
+static Entry *table;
+static size_t table_len;
+static uintmax_t dropped;
+
+static const char *out_path;
+static void (*get_state)(Sample*);
+
+static size_t hash(const Sample *s) {
+   uint64_t h = (uint64_t)s->pos.x * 0x9e3779b97f4a7c15u
+              ^ (uint64_t)s->pos.y * 0xc2b2ae3d27d4eb4fu
+              ^ (uint64_t)s->delta.x * 0x165667b19e3779f9u
+              ^ (uint64_t)s->delta.y * 0x27d4eb2f165667c5u
+              ^ s->depth << 1 ^ s->stringmode;
+   return (h ^ h >> 31) & (TABLE_SIZE - 1);
+}
+
+static bool same(const Sample *a, const Sample *b) {
+   return a->pos.x == b->pos.x && a->pos.y == b->pos.y
+       && a->delta.x == b->delta.x && a->delta.y == b->delta.y
+       && a->depth == b->depth && a->stringmode == b->stringmode;
+}
+
+static void on_sigprof(int sig) {
+   (void)sig;
+   Sample s;
+   memset(&s, 0, sizeof s);
+   get_state(&s);
+
+   for (size_t i = hash(&s);; i = (i + 1) & (TABLE_SIZE - 1)) {
+      Entry *e = &table[i];
+      if (!e->count) {
+         // Keep some room free so that probing stays short.
+         if (table_len >= TABLE_SIZE / 4 * 3) {
+            ++dropped;
+            return;
+         }
+         e->s = s;
+         e->count = 1;
+         ++table_len;
+         return;
+      }
+      if (same(&e->s, &s)) {
+         ++e->count;
+         return;
+      }
+   }
+}
+
+// The output is written from signal handlers, so it's done with nothing but
+// write(2) and hand-rolled formatting.
+typedef struct {
+   int fd;
+   size_t len;
+   char buf[4096];
+} Out;
+
+static void out_flush(Out *o) {
+   for (size_t done = 0; done < o->len;) {
+      ssize_t n = write(o->fd, o->buf + done, o->len - done);
+      if (n <= 0) {
+         if (n < 0 && errno == EINTR)
+            continue;
+         break;
+      }
+      done += n;
+   }
+   o->len = 0;
+}
+static void out_str(Out *o, const char *s) {
+   for (; *s; ++s) {
+      if (o->len == sizeof o->buf)
+         out_flush(o);
+      o->buf[o->len++] = *s;
+   }
+}
+static void out_num(Out *o, intmax_t n) {
+   char tmp[24], *p = tmp + sizeof tmp;
+   uintmax_t u = n < 0 ? -(uintmax_t)n : (uintmax_t)n;
+   *--p = 0;
+   do *--p = '0' + u % 10; while (u /= 10);
+   if (n < 0)
+      *--p = '-';
+   out_str(o, p);
+}
+// Positions and deltas may be wider than intmax_t.
+static void out_cell(Out *o, cell c) {
+   char buf[CELL_DIGITS];
+   out_str(o, cell_format(c, buf));
+}
+
+static void write_out(void) {
+   Out o;
+   o.fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (o.fd == -1)
+      return;
+   o.len = 0;
+
+   for (size_t i = 0; i < TABLE_SIZE; ++i) {
+      const Entry *e = &table[i];
+      if (!e->count)
+         continue;
+      out_str(&o, "depth ");
+      out_num(&o, e->s.depth);
+      out_str(&o, e->s.stringmode ? ";stringmode;( " : ";code;( ");
+      out_cell(&o, e->s.pos.x);
+      out_str(&o, " ");
+      out_cell(&o, e->s.pos.y);
+      out_str(&o, " ) ");
+
+      mushcoords2 d = e->s.delta;
+      if      (d.x ==  1 && d.y ==  0) out_str(&o, ">");
+      else if (d.x == -1 && d.y ==  0) out_str(&o, "<");
+      else if (d.x ==  0 && d.y == -1) out_str(&o, "^");
+      else if (d.x ==  0 && d.y ==  1) out_str(&o, "v");
+      else {
+         out_str(&o, "delta ");
+         out_cell(&o, d.x);
+         out_str(&o, ",");
+         out_cell(&o, d.y);
+      }
+      out_str(&o, " ");
+      out_num(&o, e->count);
+      out_str(&o, "\n");
+   }
+   if (dropped) {
+      out_str(&o, "(table full) ");
+      out_num(&o, dropped);
+      out_str(&o, "\n");
+   }
+   out_flush(&o);
+   close(o.fd);
+}
+
+static void on_sigusr1(int sig) {
+   (void)sig;
+   int saved_errno = errno;
+   write_out();
+   errno = saved_errno;
+}
+
+bool sample_start(const char *path, void (*state)(Sample*)) {
+   table = calloc(TABLE_SIZE, sizeof *table);
+   if (!table)
+      return false;
+   out_path  = path;
+   get_state = state;
+
+   // SIGPROF and SIGUSR1 both touch the table, so neither may interrupt the
+   // other. SA_RESTART so that the program's own I/O isn't disturbed.
+   struct sigaction sa;
+   memset(&sa, 0, sizeof sa);
+   sigemptyset(&sa.sa_mask);
+   sigaddset(&sa.sa_mask, SIGPROF);
+   sigaddset(&sa.sa_mask, SIGUSR1);
+   sa.sa_flags = SA_RESTART;
+
+   sa.sa_handler = on_sigprof;
+   if (sigaction(SIGPROF, &sa, NULL) == -1)
+      return false;
+   sa.sa_handler = on_sigusr1;
+   if (sigaction(SIGUSR1, &sa, NULL) == -1)
+      return false;
+
+   struct itimerval it;
+   it.it_interval.tv_sec  = 0;
+   it.it_interval.tv_usec = 1000000 / SAMPLE_HZ;
+   it.it_value = it.it_interval;
+   return setitimer(ITIMER_PROF, &it, NULL) == 0;
+}
+
+void sample_stop(void) {
+   if (!table)
+      return;
+
+   struct itimerval it;
+   memset(&it, 0, sizeof it);
+   setitimer(ITIMER_PROF, &it, NULL);
+
+   sigset_t set, old;
+   sigemptyset(&set);
+   sigaddset(&set, SIGPROF);
+   sigaddset(&set, SIGUSR1);
+   sigprocmask(SIG_BLOCK, &set, &old);
+   write_out();
+   sigprocmask(SIG_SETMASK, &old, NULL);
+}
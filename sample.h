@@ -0,0 +1,38 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 15:11:52
+
+// The sampling profiler enabled with -DSAMPLE. A periodic SIGPROF records the
+// state of the IP, and the samples are aggregated into the "folded stacks"
+// format understood by flamegraph tools, with the stack stack depth and mode
+// as the outer frames and the IP's position and delta as the leaf.
+//
+// The aggregate is written out when sampling stops and whenever the process
+// receives SIGUSR1, so that long-running programs can be inspected while they
+// run.
+
+#ifndef SAMPLE_H
+#define SAMPLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <mush/space.h>
+
+typedef struct {
+   mushcoords2 pos, delta;
+   size_t depth;
+   bool stringmode;
+} Sample;
+
+// Starts sampling at SAMPLE_HZ samples per second of CPU time, writing the
+// results to the given path. The given function is called from the signal
+// handler to fill in a sample, so it must be async-signal-safe. Returns false
+// and sets errno on failure.
+bool sample_start(const char *path, void (*state)(Sample*));
+
+// Stops sampling and writes the results. Does nothing if sampling was never
+// started.
+void sample_stop(void);
+
+#endif
@@ -603,6 +603,11 @@ static struct Array deque_elementsBottomToTop(const Deque *this) {
 
 /////////// CELLCONTAINER
 
+#ifdef STATS
+size_t stack_peak_capacity = 0;
+uintmax_t stack_shrinks = 0;
+#endif
+
 #ifdef MODE
 #define GET_STACK(cc) ((cc).u.stack)
 #else
@@ -669,6 +674,60 @@ void cc_push(CellContainer *this, cell c) {
       STACK_FNAME(push)(&GET_STACK(*this), c);
 }
 
+// Pushes n zeros. A Stack doesn't store long runs of them, so this can be
+// much cheaper than pushing them one at a time.
+void cc_pushZeros(CellContainer *this, size_t n) {
+#ifdef MODE
+   if (this->isDeque)
+      memset(deque_reserve(&this->u.deque, n), 0, n * sizeof(cell));
+   else
+#endif
+      STACK_FNAME(pushZeros)(&GET_STACK(*this), n);
+}
+
+// Gives back memory that a Stack isn't using, if it's a lot. Deques free
+// their chunks as they empty, so there's nothing to do for them.
+void cc_shrink(CellContainer *this) {
+#ifdef MODE
+   if (!this->isDeque)
+#endif
+      shrink_array(&GET_STACK(*this));
+}
+
+// The slow path of cc_spansNext(): finds the span below the last one.
+bool cc_spansMore(CellSpans *it) {
+   if (!it->below)
+      return false;
+#ifdef MODE
+   if (it->cc->isDeque) {
+      const Deque *d = &it->cc->u.deque;
+      Chunk *c = it->up ? (it->chunk ? it->chunk->next : d->tail)
+                        : (it->chunk ? it->chunk->prev : d->head);
+      while (c->head <= c->tail)
+         c = it->up ? c->next : c->prev;
+      it->chunk = c;
+      it->next  = (CellSpan){&c->array[c->tail], chunk_size(c)};
+   } else
+#endif
+      it->next = span_below(&GET_STACK(*it->cc), it->below, it->buf,
+                            sizeof it->buf / sizeof *it->buf);
+   it->below -= it->next.len;
+   return true;
+}
+
+// How many cells there's room for without allocating.
+size_t cc_capacity(const CellContainer *this) {
+#ifdef MODE
+   if (this->isDeque) {
+      size_t n = 0;
+      for (const Chunk *c = this->u.deque.tail; c; c = c->next)
+         n += c->capacity;
+      return n;
+   }
+#endif
+   return GET_STACK(*this).capacity;
+}
+
 size_t cc_size(const CellContainer *this) {
 #ifdef MODE
    if (this->isDeque)
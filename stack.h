@@ -5,9 +5,47 @@
 #ifndef STACK_H
 #define STACK_H
 
-typedef long cell;
+#include <stdbool.h>
+#include <stddef.h>
 
-typedef struct { cell* array; size_t capacity; size_t head; } Stack_cell;
+#include "cell.h"
+
+#ifdef NARROW_STACK
+// Cells stored at a width of 1, 2, 4, ... bytes, up to that of a cell, or
+// zeros not stored at all if the width is 0.
+typedef struct {
+   void *data;
+   size_t len, capacity;
+   unsigned char width;
+} NarrowRun;
+
+// The cells below a Stack_cell's array, bottom to top. See
+// stack_impl.inc.c.
+typedef struct {
+   NarrowRun *runs;
+   size_t len, capacity;
+   size_t cells;
+} Narrow;
+#else
+// len zeros below array[at], or on top of the array if at is head.
+typedef struct { size_t at, len; } ZeroRun;
+#endif
+
+typedef struct {
+   cell* array; size_t capacity; size_t head;
+
+#ifdef NARROW_STACK
+   Narrow cold;
+#else
+   // Long runs of zeros, as pushed by { with a negative count or by transfers
+   // from a stack with too few cells, aren't stored in the array. zeros is by
+   // ascending at, and zeroTop is the at of its last run, or zero if it's
+   // empty, so that one comparison with head finds both the runs and an
+   // empty array.
+   ZeroRun *zeros; size_t zerosLen, zerosCapacity;
+   size_t zeroTop, zeroCells;
+#endif
+} Stack_cell;
 
 struct Chunk;
 
@@ -21,6 +59,8 @@ typedef struct {
 } Deque;
 
 #ifdef MODE
+enum { INVERT_MODE = 1 << 0, QUEUE_MODE = 1 << 1 };
+
 typedef struct {
    unsigned char isDeque;
    union {
@@ -37,12 +77,92 @@ typedef struct { CellContainer** array; size_t capacity; size_t head; }
 
 CellContainer cc_init(int isDeque);
 
+// Cells next to each other in memory, bottom to top.
+typedef struct { cell *ptr; size_t len; } CellSpan;
+
+// For going down a CellContainer from the top a span at a time, so that
+// callers can loop over cells directly instead of through a callback. Cells
+// in an array are returned in place, so at most a few spans cover a Stack, and
+// one per chunk a Deque. Those that aren't stored as they are, such as runs
+// of zeros, are decoded into buf, so writes to them aren't kept.
+//
+// cc_spansFromTop() ignores queuemode, like foreachTopToBottom. With
+// cc_spansFirst(), like mapFirstN, a Deque in queuemode is instead gone up
+// from the bottom, its cells being popped from there: then up is set, and
+// the cells to be popped first are at the start of each span, not the end.
+typedef struct {
+   CellContainer *cc;
+   CellSpan next;       // What cc_spansNext() returns next, if len is nonzero.
+   size_t below;        // How many cells are below next, or above if up.
+   struct Chunk *chunk; // With a Deque, the chunk next is in.
+#ifdef MODE
+   bool up;
+#endif
+   cell buf[0400];
+} CellSpans;
+
+#ifdef STATS
+// The most cells any one Stack_cell has had room for, and the number of times
+// one has been shrunk.
+extern size_t stack_peak_capacity;
+extern uintmax_t stack_shrinks;
+#endif
+
 #ifndef Stack
 #define Stack CellContainer
 #define STACK_FNAME(s) cc_##s
 #define STACK_TY cell
 #include "stack.inc.h"
 
+void cc_pushZeros(CellContainer*, size_t);
+void cc_shrink(CellContainer*);
+size_t cc_capacity(const CellContainer*);
+
+bool cc_spansMore(CellSpans*);
+
+static inline void cc_spansFromTop(CellSpans *it, CellContainer *cc) {
+   it->cc    = cc;
+   it->chunk = NULL;
+#ifdef MODE
+   it->up    = false;
+#endif
+
+   // Usually, all of a Stack is in its array.
+#ifdef MODE
+   const Stack_cell *s = cc->isDeque ? NULL : &cc->u.stack;
+#else
+   const Stack_cell *s = cc;
+#endif
+#ifdef NARROW_STACK
+   if (s && !s->cold.cells) {
+#else
+   if (s && !s->zerosLen) {
+#endif
+      it->next  = (CellSpan){s->array, s->head};
+      it->below = 0;
+   } else {
+      it->next.len = 0;
+      it->below    = cc_size(cc);
+   }
+}
+
+static inline void cc_spansFirst(CellSpans *it, CellContainer *cc) {
+   cc_spansFromTop(it, cc);
+#ifdef MODE
+   it->up = cc->isDeque && cc->u.deque.mode & QUEUE_MODE;
+#endif
+}
+
+// Puts the next span down (or up) in *s, returning false once there are none left.
+// The spans are never empty.
+static inline bool cc_spansNext(CellSpans *it, CellSpan *s) {
+   if (!it->next.len && !cc_spansMore(it))
+      return false;
+   *s = it->next;
+   it->next.len = 0;
+   return true;
+}
+
 Stack_stack stack_stack_init(size_t n);
 
 #define Stack Stack_stack
@@ -52,8 +172,6 @@ Stack_stack stack_stack_init(size_t n);
 #endif
 
 #ifdef MODE
-enum { INVERT_MODE = 1 << 0, QUEUE_MODE = 1 << 1 };
-
 // Chunk-style implementation: keeps a doubly linked list of chunks, each of
 // which contains an array of data. Grows forwards as a stack and backwards as
 // a queue.
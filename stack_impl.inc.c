@@ -18,23 +18,550 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "stack.h"
 
+#if defined(STACK_TY_IS_CELL) && defined(NARROW_STACK)
+#define STACK_NARROW
+#elif defined(STACK_TY_IS_CELL)
+#define STACK_ZEROS
+#endif
+
+#if defined(STACK_TY_IS_CELL) && defined(STATS)
+// Called before a Stack_cell's array is shrunk or freed.
+static void shrink_note(size_t capacity) {
+   if (capacity > stack_peak_capacity)
+      stack_peak_capacity = capacity;
+}
+#endif
+
+#ifdef STACK_NARROW
+
+// With NARROW_STACK, the array of a Stack_cell only holds the cells nearest
+// its top, the window. Once the window is full, the bottom half of it is
+// moved into cold runs, each of which stores its cells at the narrowest width
+// that holds all of them, and once it's empty, it's refilled from the top of
+// the runs. Stacks that never fill the window behave as without NARROW_STACK,
+// while big ones, typically full of characters, shrink by up to 8 times.
+//
+// Cold cells are decoded into a temporary buffer for mapFirstN and the
+// foreach functions, so writes through the pointers they pass aren't kept.
+//
+// Long runs of zeros are pushed straight into a cold run of width 0, which
+// stores nothing.
+
+static const size_t
+   NARROW_WINDOW = 010000,
+   NARROW_RUN    = 0200000; // Limits the cost of widening a run
+
+static size_t narrow_min(size_t a, size_t b) { return a < b ? a : b; }
+
+// The narrowest width that holds all of the n cells at a.
+static unsigned char narrow_width(const cell *a, size_t n) {
+   ucell m = 0;
+   for (size_t i = 0; i < n; ++i)
+      m |= (ucell)(a[i] ^ (a[i] >> (CELL_BITS - 1)));
+
+   unsigned char w = 1;
+   while (w < sizeof(cell) && m >> (8 * w - 1))
+      w *= 2;
+   return w;
+}
+
+static void narrow_decode(const NarrowRun *r, size_t i, size_t n, cell *dst) {
+   switch (r->width) {
+   case 0:
+      memset(dst, 0, n * sizeof *dst);
+      return;
+#define DECODE(W, T) \
+   case W: \
+      for (size_t j = 0; j < n; ++j) \
+         dst[j] = ((const T *)r->data)[i + j]; \
+      return;
+   DECODE(1, int8_t)
+   DECODE(2, int16_t)
+#if CELL_BITS > 32
+   DECODE(4, int32_t)
+#endif
+#if CELL_BITS > 64
+   DECODE(8, int64_t)
+#endif
+#undef DECODE
+   }
+   memcpy(dst, (const cell *)r->data + i, n * sizeof *dst);
+}
+static void narrow_encode(NarrowRun *r, size_t i, const cell *src, size_t n) {
+   switch (r->width) {
+#define ENCODE(W, T) \
+   case W: \
+      for (size_t j = 0; j < n; ++j) \
+         ((T *)r->data)[i + j] = (T)src[j]; \
+      return;
+   ENCODE(1, int8_t)
+   ENCODE(2, int16_t)
+#if CELL_BITS > 32
+   ENCODE(4, int32_t)
+#endif
+#if CELL_BITS > 64
+   ENCODE(8, int64_t)
+#endif
+#undef ENCODE
+   }
+   memcpy((cell *)r->data + i, src, n * sizeof *src);
+}
+
+// Finds the run holding the i'th cell, replacing i with its index in it.
+// Searches from the top, which is where most accesses are.
+static NarrowRun *narrow_find(const Narrow *this, size_t *i) {
+   size_t beg = this->cells;
+   for (NarrowRun *r = this->runs + this->len;;) {
+      beg -= (--r)->len;
+      if (*i >= beg) {
+         *i -= beg;
+         return r;
+      }
+   }
+}
+
+static void narrow_copy(const Narrow *this, size_t i, size_t n, cell *dst) {
+   for (NarrowRun *r = narrow_find(this, &i); n; ++r, i = 0) {
+      const size_t k = narrow_min(n, r->len - i);
+      narrow_decode(r, i, k, dst);
+      dst += k;
+      n   -= k;
+   }
+}
+static cell narrow_at(const Narrow *this, size_t i) {
+   cell c;
+   narrow_copy(this, i, 1, &c);
+   return c;
+}
+
+static NarrowRun *narrow_newRun(Narrow *this, size_t k, unsigned char w) {
+   if (this->len == this->capacity) {
+      this->capacity = 2 * this->capacity + 1;
+      this->runs = realloc(this->runs, this->capacity * sizeof *this->runs);
+   }
+   memmove(&this->runs[k + 1], &this->runs[k],
+           (this->len++ - k) * sizeof *this->runs);
+
+   NarrowRun *r = &this->runs[k];
+   r->data  = NULL;
+   r->len   = r->capacity = 0;
+   r->width = w;
+   return r;
+}
+
+// Makes the i'th zero of the k'th run, which is of width 0, into c by
+// splitting the run around it.
+static void narrow_splitZeros(Narrow *this, size_t k, size_t i, cell c) {
+   const size_t above = this->runs[k].len - i - 1;
+   this->runs[k].len = i;
+
+   NarrowRun *r = narrow_newRun(this, k + 1, narrow_width(&c, 1));
+   r->len = r->capacity = 1;
+   r->data = malloc(r->width);
+   narrow_encode(r, 0, &c, 1);
+
+   narrow_newRun(this, k + 2, 0)->len = above;
+}
+
+static void narrow_setAt(Narrow *this, size_t i, cell c) {
+   NarrowRun *r = narrow_find(this, &i);
+   if (!r->width) {
+      if (c)
+         narrow_splitZeros(this, (size_t)(r - this->runs), i, c);
+      return;
+   }
+   const unsigned char w = narrow_width(&c, 1);
+   if (w > r->width) {
+      cell *tmp = malloc(r->len * sizeof *tmp);
+      narrow_decode(r, 0, r->len, tmp);
+      r->width    = w;
+      r->capacity = r->len;
+      r->data     = realloc(r->data, r->capacity * w);
+      narrow_encode(r, 0, tmp, r->len);
+      free(tmp);
+   }
+   narrow_encode(r, i, &c, 1);
+}
+
+// Appends the n cells at a, a window's worth at a time so that a few wide
+// cells don't widen everything around them.
+static void narrow_push(Narrow *this, const cell *a, size_t n) {
+   while (n) {
+      size_t k = narrow_min(n, NARROW_WINDOW / 2);
+      const unsigned char w = narrow_width(a, k);
+
+      NarrowRun *r = this->len ? &this->runs[this->len - 1] : NULL;
+      if (!r || r->width != w || r->len == NARROW_RUN)
+         r = narrow_newRun(this, this->len, w);
+
+      k = narrow_min(k, NARROW_RUN - r->len);
+      if (r->capacity < r->len + k) {
+         r->capacity = narrow_min(
+            NARROW_RUN, 2 * r->capacity + (r->len + k > 2 * r->capacity
+                                           ? r->len + k : 0));
+         r->data = realloc(r->data, r->capacity * w);
+      }
+      narrow_encode(r, r->len, a, k);
+      r->len      += k;
+      this->cells += k;
+      a += k;
+      n -= k;
+   }
+}
+
+static void narrow_pushZeros(Narrow *this, size_t n) {
+   NarrowRun *r = this->len ? &this->runs[this->len - 1] : NULL;
+   if (!r || r->width)
+      r = narrow_newRun(this, this->len, 0);
+   r->len      += n;
+   this->cells += n;
+}
+
+// Drops the top n cells, or all of them if there are fewer.
+static void narrow_popN(Narrow *this, size_t n) {
+   n = narrow_min(n, this->cells);
+   this->cells -= n;
+   while (n) {
+      NarrowRun *r = &this->runs[this->len - 1];
+      if (n < r->len) {
+         r->len -= n;
+         break;
+      }
+      n -= r->len;
+      free(r->data);
+      --this->len;
+   }
+}
+
+static void narrow_free(Narrow *this) {
+   narrow_popN(this, this->cells);
+   free(this->runs);
+}
+
+// Calls f over the top n cells, bottom to top, a buffer's worth at a time.
+static void narrow_mapFirstN(
+   const Narrow *this, size_t n, void (*f)(cell*, size_t))
+{
+   cell buf[0400];
+   for (size_t i = this->cells - n; i < this->cells;) {
+      const size_t k = narrow_min(this->cells - i, sizeof buf / sizeof *buf);
+      narrow_copy(this, i, k, buf);
+      f(buf, k);
+      i += k;
+   }
+}
+
+// Calls f on each cell, bottom to top or top to bottom, until it returns
+// zero. Returns whether it never did.
+static bool narrow_foreach(const Narrow *this, int (*f)(cell*), bool down) {
+   cell buf[0400];
+   for (size_t done = 0; done < this->cells;) {
+      const size_t k = narrow_min(this->cells - done, sizeof buf / sizeof *buf);
+      narrow_copy(this, down ? this->cells - done - k : done, k, buf);
+      for (size_t j = 0; j < k; ++j)
+         if (!f(&buf[down ? k - 1 - j : j]))
+            return false;
+      done += k;
+   }
+   return true;
+}
+
+// Moves all but the top keep cells of the window into the runs, and shrinks
+// the window back down if a big reserve grew it.
+static void narrow_spill(Stack_cell *s, size_t keep) {
+   const size_t n = s->head - keep;
+   narrow_push(&s->cold, s->array, n);
+   memmove(s->array, s->array + n, keep * sizeof *s->array);
+   s->head = keep;
+
+   if (s->capacity > NARROW_WINDOW) {
+#ifdef STATS
+      shrink_note(s->capacity);
+#endif
+      s->capacity = NARROW_WINDOW;
+      s->array = realloc(s->array, s->capacity * sizeof *s->array);
+   }
+}
+
+// Fills the empty window with up to half its size from the top of the runs,
+// and pops from it. Kept out of line so that pop() needs no stack frame.
+__attribute__((noinline)) static cell narrow_pop(Stack_cell *s) {
+   const size_t n = narrow_min(s->cold.cells, NARROW_WINDOW / 2);
+   if (s->capacity < n) {
+      s->capacity = n;
+      s->array = realloc(s->array, s->capacity * sizeof *s->array);
+   }
+   narrow_copy(&s->cold, s->cold.cells - n, n, s->array);
+   narrow_popN(&s->cold, n);
+   s->head = n;
+   return s->array[--s->head];
+}
+#endif
+
+#ifdef STACK_ZEROS
+
+// Runs of zeros are only kept out of the array if they're at least this long,
+// so that the array doesn't get split up for nothing.
+static const size_t ZEROS_MIN = 0400;
+
+static size_t zeros_min(size_t a, size_t b) { return a < b ? a : b; }
+
+static void zeros_settle(Stack_cell *s) {
+   s->zeroTop = s->zerosLen ? s->zeros[s->zerosLen - 1].at : 0;
+}
+
+static void zeros_insert(Stack_cell *s, size_t k, size_t at, size_t len) {
+   if (s->zerosLen == s->zerosCapacity) {
+      s->zerosCapacity = 2 * s->zerosCapacity + 1;
+      s->zeros = realloc(s->zeros, s->zerosCapacity * sizeof *s->zeros);
+   }
+   memmove(&s->zeros[k + 1], &s->zeros[k],
+           (s->zerosLen++ - k) * sizeof *s->zeros);
+   s->zeros[k] = (ZeroRun){at, len};
+}
+static void zeros_remove(Stack_cell *s, size_t k) {
+   memmove(&s->zeros[k], &s->zeros[k + 1],
+           (--s->zerosLen - k) * sizeof *s->zeros);
+}
+
+// pop() when the array has nothing above the runs. Kept out of line like
+// narrow_pop().
+__attribute__((noinline)) static cell zeros_pop(Stack_cell *s) {
+   if (!s->zerosLen)
+      return 0;
+   --s->zeroCells;
+   if (!--s->zeros[s->zerosLen - 1].len) {
+      --s->zerosLen;
+      zeros_settle(s);
+   }
+   return 0;
+}
+
+// Finds the i'th cell, returning the index of the run holding it and
+// replacing i with its index in that, or returning zerosLen and replacing i
+// with its index in the array. Searches from the top like narrow_find().
+static size_t zeros_find(const Stack_cell *s, size_t *i) {
+   size_t below = s->zeroCells;
+   for (size_t k = s->zerosLen; k-- > 0;) {
+      const ZeroRun *r = &s->zeros[k];
+      below -= r->len;
+      const size_t beg = r->at + below;
+      if (*i >= beg + r->len) {
+         *i -= below + r->len;
+         return s->zerosLen;
+      }
+      if (*i >= beg) {
+         *i -= beg;
+         return k;
+      }
+   }
+   return s->zerosLen;
+}
+
+// Makes the i'th zero of the k'th run into c by moving it into the array,
+// splitting the run around it.
+static void zeros_split(Stack_cell *s, size_t k, size_t i, cell c) {
+   if (!c)
+      return;
+
+   const size_t at = s->zeros[k].at, above = s->zeros[k].len - i - 1;
+   if (s->head == s->capacity) {
+      s->capacity = 2 * s->capacity + 1;
+      s->array = realloc(s->array, s->capacity * sizeof *s->array);
+   }
+   memmove(&s->array[at + 1], &s->array[at],
+           (s->head++ - at) * sizeof *s->array);
+   s->array[at] = c;
+
+   for (size_t j = k + 1; j < s->zerosLen; ++j)
+      ++s->zeros[j].at;
+   --s->zeroCells;
+
+   s->zeros[k].len = i;
+   if (above)
+      zeros_insert(s, k + 1, at + 1, above);
+   if (!i)
+      zeros_remove(s, k);
+   zeros_settle(s);
+}
+
+// mapFirstN() when some of the cells are in runs. The zeros are passed from
+// a buffer, so writes through the pointers aren't kept.
+static void zeros_mapFirstN(
+   Stack_cell *s, size_t n, void (*f)(cell*, size_t), void (*g)(size_t))
+{
+   const size_t size = s->head + s->zeroCells;
+   if (n > size) {
+      g(n - size);
+      n = size;
+   }
+
+   cell zero[0400] = {0};
+   size_t skip = size - n, a = 0;
+   for (size_t k = 0;; ++k) {
+      const size_t to = k < s->zerosLen ? s->zeros[k].at : s->head;
+      if (skip < to - a)
+         f(&s->array[a + skip], to - a - skip);
+      skip -= zeros_min(skip, to - a);
+      a = to;
+      if (k == s->zerosLen)
+         break;
+
+      const size_t len = s->zeros[k].len;
+      for (size_t left = skip < len ? len - skip : 0; left;) {
+         const size_t m = zeros_min(left, sizeof zero / sizeof *zero);
+         f(zero, m);
+         left -= m;
+      }
+      skip -= zeros_min(skip, len);
+   }
+}
+
+static bool zeros_each(size_t n, int (*f)(cell*)) {
+   for (; n; --n) {
+      cell zero = 0;
+      if (!f(&zero))
+         return false;
+   }
+   return true;
+}
+
+// The foreach functions when there are runs, bottom to top or top to bottom.
+static void zeros_foreach(Stack_cell *s, int (*f)(cell*), bool down) {
+   if (!down) {
+      size_t a = 0;
+      for (size_t k = 0; k <= s->zerosLen; ++k) {
+         const size_t to = k < s->zerosLen ? s->zeros[k].at : s->head;
+         for (; a < to; ++a)
+            if (!f(&s->array[a]))
+               return;
+         if (k < s->zerosLen && !zeros_each(s->zeros[k].len, f))
+            return;
+      }
+   } else {
+      size_t a = s->head;
+      for (size_t k = s->zerosLen + 1; k-- > 0;) {
+         const size_t to = k ? s->zeros[k - 1].at : 0;
+         while (a > to)
+            if (!f(&s->array[--a]))
+               return;
+         if (k && !zeros_each(s->zeros[k - 1].len, f))
+            return;
+      }
+   }
+}
+#endif
+
+#ifdef STACK_TY_IS_CELL
+
+// Arrays are only ever grown on the way up, so a stack that has had a spike
+// is shrunk once less than a quarter of its array is in use, to twice what
+// is. The gap keeps a stack that goes up and down from reallocating all the
+// time, and small arrays are left alone.
+static const size_t SHRINK_MIN = 0200000;
+
+static void shrink_array(Stack_cell *s) {
+#ifdef STATS
+   shrink_note(s->capacity);
+#endif
+   if (s->capacity <= SHRINK_MIN || s->head >= s->capacity / 4)
+      return;
+   const size_t n = s->head < SHRINK_MIN / 2 ? SHRINK_MIN : 2 * s->head;
+
+#ifdef MADV_DONTNEED
+   // realloc() may hang on to what it's given back, so return the pages to
+   // the system first.
+   const uintptr_t page = ~((uintptr_t)sysconf(_SC_PAGESIZE) - 1),
+                   beg  = ((uintptr_t)(s->array + n) + ~page) & page,
+                   end  = (uintptr_t)(s->array + s->capacity) & page;
+   if (beg < end)
+      madvise((void*)beg, end - beg, MADV_DONTNEED);
+#endif
+   s->capacity = n;
+   s->array    = realloc(s->array, s->capacity * sizeof *s->array);
+#ifdef STATS
+   ++stack_shrinks;
+#endif
+}
+
+// The span ending just below the end'th cell, for cc_spansMore(). Cells not
+// in the array go in buf, which has room for max.
+static CellSpan span_below(Stack_cell *s, size_t end, cell *buf, size_t max) {
+#ifdef STACK_NARROW
+   if (end > s->cold.cells)
+      return (CellSpan){s->array, end - s->cold.cells};
+   const size_t n = narrow_min(end, max);
+   narrow_copy(&s->cold, end - n, n, buf);
+   return (CellSpan){buf, n};
+#else
+   size_t above = s->zeroCells;
+   for (size_t k = s->zerosLen; k-- > 0;) {
+      const ZeroRun *r = &s->zeros[k];
+      const size_t below = above - r->len, beg = r->at + below;
+      if (end > beg + r->len)
+         return (CellSpan){&s->array[r->at], end - above - r->at};
+      if (end > beg) {
+         const size_t n = zeros_min(end - beg, max);
+         memset(buf, 0, n * sizeof *buf);
+         return (CellSpan){buf, n};
+      }
+      above = below;
+   }
+   return (CellSpan){s->array, end};
+#endif
+}
+#endif
+
+#ifdef STACK_NARROW
+size_t STACK_FNAME(size)(const Stack *this) {
+   return this->cold.cells + this->head;
+}
+bool STACK_FNAME(empty)(const Stack *this) {
+   return this->head == 0 && this->cold.cells == 0;
+}
+#elif defined(STACK_ZEROS)
+size_t STACK_FNAME(size)(const Stack *this) {
+   return this->head + this->zeroCells;
+}
+bool STACK_FNAME(empty)(const Stack *this) {
+   return this->head == 0 && this->zeroCells == 0;
+}
+#else
 size_t STACK_FNAME(size) (const Stack *this) { return this->head; }
 bool   STACK_FNAME(empty)(const Stack *this) { return this->head == 0; }
+#endif
 
 Stack STACK_FNAME(init)(size_t n) {
    Stack x;
    x.head     = 0;
    x.capacity = n;
    x.array    = malloc(x.capacity * sizeof *x.array);
+#ifdef STACK_NARROW
+   x.cold     = (Narrow){NULL, 0, 0, 0};
+#elif defined(STACK_ZEROS)
+   x.zeros    = NULL;
+   x.zerosLen = x.zerosCapacity = x.zeroTop = x.zeroCells = 0;
+#endif
    return x;
 }
 
 Stack STACK_FNAME(initFromStack)(Stack s) {
    Stack x;
+#ifdef STACK_ZEROS
+   x.head     = s.head;
+   x.zeros    = malloc(s.zerosLen * sizeof *x.zeros);
+   x.zerosLen = x.zerosCapacity = s.zerosLen;
+   x.zeroTop  = s.zeroTop;
+   x.zeroCells = s.zeroCells;
+   memcpy(x.zeros, s.zeros, s.zerosLen * sizeof *x.zeros);
+#else
    x.head     = STACK_FNAME(size)(&s);
+#endif
    x.capacity = s.capacity;
    x.array    = malloc(x.capacity * sizeof *x.array);
    memcpy(x.array, s.array, x.head);
@@ -50,6 +577,12 @@ Stack STACK_FNAME(initFromDeque)(Deque q) {
    x.head     = arr.length;
    x.capacity = arr.length;
    x.array    = arr.ptr;
+#ifdef STACK_NARROW
+   x.cold     = (Narrow){NULL, 0, 0, 0};
+#else
+   x.zeros    = NULL;
+   x.zerosLen = x.zerosCapacity = x.zeroTop = x.zeroCells = 0;
+#endif
 #else
    (void)q;
    assert (false && "Trying to make non-cell stack out of deque");
@@ -58,9 +591,28 @@ Stack STACK_FNAME(initFromDeque)(Deque q) {
 }
 #endif
 
-void STACK_FNAME(free)(Stack *this) { free(this->array); }
+void STACK_FNAME(free)(Stack *this) {
+#if defined(STACK_TY_IS_CELL) && defined(STATS)
+   shrink_note(this->capacity);
+#endif
+   free(this->array);
+#ifdef STACK_NARROW
+   narrow_free(&this->cold);
+#elif defined(STACK_ZEROS)
+   free(this->zeros);
+#endif
+}
 
 STACK_TY STACK_FNAME(pop)(Stack *this) {
+#ifdef STACK_ZEROS
+   // Also catches the empty stack, which it's not an error to pop.
+   if (this->head == this->zeroTop)
+      return zeros_pop(this);
+#else
+#ifdef STACK_NARROW
+   if (this->head == 0 && this->cold.cells)
+      return narrow_pop(this);
+#endif
    // not an error to pop an empty stack
    if (STACK_FNAME(empty)(this)) {
 #ifdef STACK_TY_IS_CELL
@@ -69,10 +621,36 @@ STACK_TY STACK_FNAME(pop)(Stack *this) {
       assert (false && "Attempted to pop empty non-cell stack.");
 #endif
    }
+#endif
    return this->array[--this->head];
 }
 
 void STACK_FNAME(popN)(Stack *this, size_t i) {
+#ifdef STACK_NARROW
+   if (i > this->head) {
+      narrow_popN(&this->cold, i - this->head);
+      this->head = 0;
+      return;
+   }
+#elif defined(STACK_ZEROS)
+   while (i && this->zerosLen) {
+      if (this->head > this->zeroTop) {
+         const size_t k = zeros_min(i, this->head - this->zeroTop);
+         this->head -= k;
+         i          -= k;
+         continue;
+      }
+      ZeroRun *r = &this->zeros[this->zerosLen - 1];
+      const size_t k = zeros_min(i, r->len);
+      r->len          -= k;
+      this->zeroCells -= k;
+      i               -= k;
+      if (!r->len) {
+         --this->zerosLen;
+         zeros_settle(this);
+      }
+   }
+#endif
    if (i >= this->head)
       this->head = 0;
    else
@@ -84,9 +662,21 @@ void STACK_FNAME(popNPushed)(Stack *this, size_t n) {
 
 void STACK_FNAME(clear)(Stack *this) {
    this->head = 0;
+#ifdef STACK_NARROW
+   narrow_popN(&this->cold, this->cold.cells);
+#elif defined(STACK_ZEROS)
+   this->zerosLen = this->zeroTop = this->zeroCells = 0;
+#endif
+#ifdef STACK_TY_IS_CELL
+   shrink_array(this);
+#endif
 }
 
 STACK_TY STACK_FNAME(top)(const Stack *this) {
+#ifdef STACK_ZEROS
+   if (this->head == this->zeroTop)
+      return 0;
+#endif
    if (STACK_FNAME(empty)(this)) {
 #ifdef STACK_TY_IS_CELL
       return 0;
@@ -94,15 +684,32 @@ STACK_TY STACK_FNAME(top)(const Stack *this) {
       assert (false && "Attempted to peek empty non-cell stack.");
 #endif
    }
+#ifdef STACK_NARROW
+   if (this->head == 0)
+      return narrow_at(&this->cold, this->cold.cells - 1);
+#endif
    return this->array[this->head-1];
 }
 STACK_TY STACK_FNAME(topPushed)(const Stack *this) {
    assert (!STACK_FNAME(empty)(this));
+#ifdef STACK_NARROW
+   if (this->head == 0)
+      return narrow_at(&this->cold, this->cold.cells - 1);
+#elif defined(STACK_ZEROS)
+   if (this->head == this->zeroTop)
+      return 0;
+#endif
    return this->array[this->head-1];
 }
 
 void STACK_FNAME(push)(Stack *this, STACK_TY t) {
    size_t neededRoom = this->head + 1;
+#ifdef STACK_NARROW
+   if (neededRoom > this->capacity && this->head >= NARROW_WINDOW) {
+      narrow_spill(this, NARROW_WINDOW / 2);
+      neededRoom = this->head + 1;
+   }
+#endif
    if (neededRoom > this->capacity) {
       this->capacity = 2 * this->capacity +
          (neededRoom > 2 * this->capacity ? neededRoom : 0);
@@ -115,6 +722,11 @@ void STACK_FNAME(push)(Stack *this, STACK_TY t) {
 
 
 STACK_TY* STACK_FNAME(reserve)(Stack *this, size_t n) {
+#ifdef STACK_NARROW
+   if (this->capacity < n + this->head && n + this->head > NARROW_WINDOW)
+      narrow_spill(this, n < NARROW_WINDOW / 2
+                         ? narrow_min(this->head, NARROW_WINDOW / 2 - n) : 0);
+#endif
    if (this->capacity < n + this->head) {
       this->capacity = n + this->head;
       this->array = realloc(this->array, this->capacity * sizeof *this->array);
@@ -129,15 +741,53 @@ STACK_TY* STACK_FNAME(reserve)(Stack *this, size_t n) {
 }
 
 STACK_TY STACK_FNAME(at)(const Stack *this, size_t i) {
+#ifdef STACK_NARROW
+   if (i < this->cold.cells)
+      return narrow_at(&this->cold, i);
+   i -= this->cold.cells;
+#elif defined(STACK_ZEROS)
+   if (zeros_find(this, &i) < this->zerosLen)
+      return 0;
+#endif
    return this->array[i];
 }
 STACK_TY STACK_FNAME(setAt)(Stack *this, size_t i, STACK_TY t) {
+#ifdef STACK_NARROW
+   if (i < this->cold.cells) {
+      narrow_setAt(&this->cold, i, t);
+      return t;
+   }
+   i -= this->cold.cells;
+#elif defined(STACK_ZEROS)
+   const size_t k = zeros_find(this, &i);
+   if (k < this->zerosLen) {
+      zeros_split(this, k, i, t);
+      return t;
+   }
+#endif
    return this->array[i] = t;
 }
 
 void STACK_FNAME(mapFirstN)(
    Stack *this, size_t n, void (*f)(STACK_TY*, size_t), void (*g)(size_t))
 {
+#ifdef STACK_NARROW
+   if (n > this->head && this->cold.cells) {
+      const size_t size = STACK_FNAME(size)(this);
+      if (n > size) {
+         g(n - size);
+         n = size;
+      }
+      narrow_mapFirstN(&this->cold, n - this->head, f);
+      f(this->array, this->head);
+      return;
+   }
+#elif defined(STACK_ZEROS)
+   if (this->zerosLen && n > this->head - this->zeroTop) {
+      zeros_mapFirstN(this, n, f, g);
+      return;
+   }
+#endif
    if (n <= this->head)
       f(&this->array[this->head - n], n);
    else {
@@ -157,20 +807,65 @@ void STACK_FNAME(mapFirstNPushed)(
 }
 
 void STACK_FNAME(foreach)(Stack *this, int (*f)(STACK_TY*)) {
+#ifdef STACK_NARROW
+   if (!narrow_foreach(&this->cold, f, false))
+      return;
+#elif defined(STACK_ZEROS)
+   if (this->zerosLen) {
+      zeros_foreach(this, f, false);
+      return;
+   }
+#endif
    for (size_t i = 0; i < this->head; ++i)
       if (!f(&this->array[i]))
          break;
 }
 void STACK_FNAME(foreachTopToBottom)(Stack *this, int (*f)(STACK_TY*)) {
+#ifdef STACK_ZEROS
+   if (this->zerosLen) {
+      zeros_foreach(this, f, true);
+      return;
+   }
+#endif
    for (size_t i = this->head; i-- > 0;)
       if (!f(&this->array[i]))
-         break;
+         return;
+#ifdef STACK_NARROW
+   narrow_foreach(&this->cold, f, true);
+#endif
 }
 void STACK_FNAME(foreachBottomToTop)(Stack *this, int (*f)(STACK_TY*)) {
    STACK_FNAME(foreach)(this, f);
 }
 
+#ifdef STACK_TY_IS_CELL
+// Pushes n zeros, without storing them one by one if there are many.
+static void STACK_FNAME(pushZeros)(Stack *this, size_t n) {
+#ifdef STACK_NARROW
+   if (n >= NARROW_WINDOW / 2) {
+      narrow_spill(this, 0);
+      narrow_pushZeros(&this->cold, n);
+      return;
+   }
+#else
+   if (n >= ZEROS_MIN) {
+      if (this->zerosLen && this->zeroTop == this->head)
+         this->zeros[this->zerosLen - 1].len += n;
+      else {
+         zeros_insert(this, this->zerosLen, this->head, n);
+         this->zeroTop = this->head;
+      }
+      this->zeroCells += n;
+      return;
+   }
+#endif
+   memset(STACK_FNAME(reserve)(this, n), 0, n * sizeof *this->array);
+}
+#endif
+
 #undef Stack
 #undef STACK_FNAME
 #undef STACK_TY
 #undef STACK_TY_IS_CELL
+#undef STACK_NARROW
+#undef STACK_ZEROS
@@ -0,0 +1,521 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 16:20:05
+
+#define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+static const unsigned char MAGIC[8] = "HALITRC\1";
+
+enum {
+   TAG_STEP, TAG_INPUT, TAG_EOF, TAG_CHECKPOINT, TAG_END, TAG_FILE, TAG_NOFILE
+};
+
+uintmax_t trace_insns = 0, trace_stop_at = UINTMAX_MAX;
+
+static const char *arg0;
+
+static enum { OFF, RECORDING, REPLAYING } mode = OFF;
+
+bool trace_recording(void) { return mode == RECORDING; }
+bool trace_replaying(void) { return mode == REPLAYING; }
+
+static uint64_t fnv1a(const unsigned char *p, size_t len) {
+   uint64_t h = 0xcbf29ce484222325u;
+   while (len--)
+      h = (h ^ *p++) * 0x100000001b3u;
+   return h;
+}
+
+// Wide enough for both cells and counts.
+#if CELL_BITS > 64
+typedef ucell uvarint;
+#else
+typedef uintmax_t uvarint;
+#endif
+
+static uvarint zigzag(cell c) {
+   return ((uvarint)c << 1) ^ (uvarint)(c < 0 ? -1 : 0);
+}
+static cell unzigzag(uvarint u) {
+   return (cell)(u >> 1) ^ -(cell)(u & 1);
+}
+
+/////////// RECORDING
+
+// The main thread fills buffers which the writer thread writes out. There are
+// a handful of them so that the main thread only has to wait if the disk
+// can't keep up.
+enum { BUF_SIZE = 1 << 16, NBUFS = 4 };
+
+static unsigned char bufs[NBUFS][BUF_SIZE];
+static size_t buf_len = 0;
+
+// Buffers [written, filled) are waiting to be written; buffer filled % NBUFS
+// is the one being filled.
+static size_t written = 0, filled = 0;
+static bool finished = false;
+
+static pthread_t writer;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int out_fd;
+static size_t last_len;
+static bool write_failed = false;
+
+static void *writer_main(void *unused) {
+   (void)unused;
+   pthread_mutex_lock(&mutex);
+   for (;;) {
+      while (written == filled && !finished)
+         pthread_cond_wait(&cond, &mutex);
+      if (written == filled)
+         break;
+
+      const unsigned char *buf = bufs[written % NBUFS];
+      size_t len = written + 1 == filled && finished ? last_len : BUF_SIZE;
+      pthread_mutex_unlock(&mutex);
+
+      for (size_t done = 0; done < len;) {
+         ssize_t n = write(out_fd, buf + done, len - done);
+         if (n < 0 && errno == EINTR)
+            continue;
+         if (n <= 0) {
+            write_failed = true;
+            break;
+         }
+         done += n;
+      }
+
+      pthread_mutex_lock(&mutex);
+      ++written;
+      pthread_cond_broadcast(&cond);
+   }
+   pthread_mutex_unlock(&mutex);
+   return NULL;
+}
+
+static void submit(void) {
+   pthread_mutex_lock(&mutex);
+   ++filled;
+   pthread_cond_broadcast(&cond);
+   while (filled - written == NBUFS)
+      pthread_cond_wait(&cond, &mutex);
+   pthread_mutex_unlock(&mutex);
+   buf_len = 0;
+}
+
+static void emit(unsigned char b) {
+   if (buf_len == BUF_SIZE)
+      submit();
+   bufs[filled % NBUFS][buf_len++] = b;
+}
+static void emit_uvarint(uvarint u) {
+   while (u >= 0x80) {
+      emit((unsigned char)u | 0x80);
+      u >>= 7;
+   }
+   emit((unsigned char)u);
+}
+static void emit_varint(cell c) { emit_uvarint(zigzag(c)); }
+static void emit_coords(mushcoords2 c) {
+   emit_varint(c.x);
+   emit_varint(c.y);
+}
+
+// The step run being accumulated: run_len instructions, each at the previous
+// one's position plus run_delta.
+static mushcoords2 prev_pos, run_delta;
+static uintmax_t run_len = 0;
+
+static void flush_run(void) {
+   if (!run_len)
+      return;
+   emit(TAG_STEP);
+   emit_uvarint(run_len);
+   emit_coords(run_delta);
+   run_len = 0;
+}
+
+bool trace_record_start(
+   const char *a0, const char *path, const unsigned char *code, size_t len)
+{
+   arg0 = a0;
+   out_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if (out_fd == -1)
+      return false;
+   if ((errno = pthread_create(&writer, NULL, writer_main, NULL))) {
+      close(out_fd);
+      return false;
+   }
+   mode = RECORDING;
+
+   for (size_t i = 0; i < sizeof MAGIC; ++i)
+      emit(MAGIC[i]);
+   emit(sizeof(cell));
+   emit_uvarint(len);
+   emit_uvarint(fnv1a(code, len));
+
+   prev_pos = MUSHCOORDS2(0,0);
+   trace_stop_at = TRACE_CHECKPOINT_INTERVAL;
+   return true;
+}
+
+void trace_record_stop(void) {
+   if (mode != RECORDING)
+      return;
+   mode = OFF;
+
+   flush_run();
+   emit(TAG_END);
+   emit_uvarint(trace_insns);
+
+   pthread_mutex_lock(&mutex);
+   last_len = buf_len;
+   ++filled;
+   finished = true;
+   pthread_cond_broadcast(&cond);
+   pthread_mutex_unlock(&mutex);
+   pthread_join(writer, NULL);
+
+   if (close(out_fd) == -1 || write_failed)
+      fprintf(stderr, "%s: trace: writing failed, the log is incomplete\n",
+              arg0);
+}
+
+bool trace_checkpoint_wanted(const mushbounds2 *b) {
+   uint64_t w = (uint64_t)b->end.x - b->beg.x + 1,
+            h = (uint64_t)b->end.y - b->beg.y + 1;
+   return b->end.x < b->beg.x || b->end.y < b->beg.y
+       || (w <= TRACE_CHECKPOINT_MAX_AREA && h <= TRACE_CHECKPOINT_MAX_AREA / w);
+}
+
+void trace_checkpoint(const TraceState *st) {
+   trace_stop_at += TRACE_CHECKPOINT_INTERVAL;
+   if (!st)
+      return;
+
+   flush_run();
+   emit(TAG_CHECKPOINT);
+   emit_uvarint(trace_insns);
+   emit_coords(prev_pos);
+   emit_coords(st->pos);
+   emit_coords(st->delta);
+   emit_coords(st->offset);
+   emit(st->stringmode | st->strn_enabled << 1);
+
+   emit_uvarint(st->nstacks);
+   for (size_t s = 0; s < st->nstacks; ++s) {
+      const CellContainer *cc = st->stacks[s];
+      size_t n = cc_size(cc);
+      emit_uvarint(n);
+      for (size_t i = 0; i < n; ++i)
+         emit_varint(cc_at(cc, i));
+   }
+
+   // Funge-space is mostly spaces, so spaces are run-length encoded: each
+   // run is preceded by its length, shifted left by one and with the low bit
+   // set if it's a run of spaces.
+   emit_coords(st->bounds.beg);
+   emit_coords(st->bounds.end);
+   size_t area = 0;
+   if (st->bounds.end.x >= st->bounds.beg.x
+    && st->bounds.end.y >= st->bounds.beg.y)
+      area = (size_t)(st->bounds.end.x - st->bounds.beg.x + 1)
+           * (size_t)(st->bounds.end.y - st->bounds.beg.y + 1);
+   for (size_t i = 0; i < area;) {
+      size_t j = i;
+      const bool spaces = st->cells[i] == ' ';
+      while (j < area && (st->cells[j] == ' ') == spaces)
+         ++j;
+      emit_uvarint((uintmax_t)(j - i) << 1 | spaces);
+      if (!spaces)
+         for (; i < j; ++i)
+            emit_varint(st->cells[i]);
+      i = j;
+   }
+}
+
+/////////// REPLAYING
+
+static const unsigned char *log_beg, *log_pos, *log_end;
+static size_t log_size;
+
+static _Noreturn void bad_log(void) {
+   fprintf(stderr, "%s: trace: log is corrupt or truncated\n", arg0);
+   exit(2);
+}
+
+static unsigned char take(void) {
+   if (log_pos == log_end)
+      bad_log();
+   return *log_pos++;
+}
+static uvarint take_uvarint(void) {
+   uvarint u = 0;
+   for (unsigned shift = 0;; shift += 7) {
+      unsigned char b = take();
+      if (shift >= sizeof u * 8)
+         bad_log();
+      u |= (uvarint)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+         return u;
+   }
+}
+static cell take_varint(void) { return unzigzag(take_uvarint()); }
+static mushcoords2 take_coords(void) {
+   mushcoords2 c;
+   c.x = take_varint();
+   c.y = take_varint();
+   return c;
+}
+
+// Reads a checkpoint after its tag, into st if it's not null.
+static void take_checkpoint(TraceState *st) {
+   take_uvarint();
+   mushcoords2 prev = take_coords();
+   TraceState s;
+   s.pos    = take_coords();
+   s.delta  = take_coords();
+   s.offset = take_coords();
+   unsigned char flags = take();
+   s.stringmode   = flags & 1;
+   s.strn_enabled = flags & 2;
+
+   s.nstacks = take_uvarint();
+   if (st)
+      s.stacks = malloc(s.nstacks * sizeof *s.stacks);
+   for (size_t i = 0; i < s.nstacks; ++i) {
+      size_t n = take_uvarint();
+      if (st) {
+         s.stacks[i] = malloc(sizeof *s.stacks[i]);
+         *s.stacks[i] = cc_init(0);
+         cell *p = cc_reserve(s.stacks[i], n);
+         while (n--)
+            *p++ = take_varint();
+      } else
+         while (n--)
+            take_uvarint();
+   }
+
+   s.bounds.beg = take_coords();
+   s.bounds.end = take_coords();
+   size_t area = 0;
+   if (s.bounds.end.x >= s.bounds.beg.x && s.bounds.end.y >= s.bounds.beg.y)
+      area = (size_t)(s.bounds.end.x - s.bounds.beg.x + 1)
+           * (size_t)(s.bounds.end.y - s.bounds.beg.y + 1);
+   s.cells = st ? malloc(area * sizeof *s.cells) : NULL;
+   for (size_t i = 0; i < area;) {
+      uintmax_t run = take_uvarint();
+      size_t n = run >> 1;
+      if (n > area - i)
+         bad_log();
+      if (run & 1) {
+         if (st)
+            for (size_t j = 0; j < n; ++j)
+               s.cells[i + j] = ' ';
+      } else
+         for (size_t j = 0; j < n; ++j) {
+            cell c = take_varint();
+            if (st)
+               s.cells[i + j] = c;
+         }
+      i += n;
+   }
+
+   if (st) {
+      *st = s;
+      prev_pos = prev;
+   }
+}
+
+// Skips over the record whose tag was just read.
+static void skip_record(unsigned char tag) {
+   switch (tag) {
+   case TAG_STEP:       take_uvarint(); take_coords(); break;
+   case TAG_INPUT:      take_uvarint();                break;
+   case TAG_EOF:                                       break;
+   case TAG_CHECKPOINT: take_checkpoint(NULL);         break;
+   case TAG_END:        take_uvarint();                break;
+   case TAG_FILE:       take_uvarint(); take_uvarint(); break;
+   case TAG_NOFILE:                                    break;
+   default:             bad_log();
+   }
+}
+
+bool trace_replay_start(
+   const char *a0, const char *path, const unsigned char *code, size_t len,
+   uintmax_t stop, TraceState *st, bool *restored)
+{
+   arg0 = a0;
+   *restored = false;
+
+   int fd = open(path, O_RDONLY);
+   if (fd == -1)
+      return false;
+   struct stat s;
+   if (fstat(fd, &s) == -1) {
+      close(fd);
+      return false;
+   }
+   log_size = s.st_size;
+   log_beg = mmap(NULL, log_size ? log_size : 1, PROT_READ, MAP_PRIVATE, fd,
+                  0);
+   close(fd);
+   if (log_beg == MAP_FAILED)
+      return false;
+   log_pos = log_beg;
+   log_end = log_beg + log_size;
+
+   if (log_size < sizeof MAGIC || memcmp(log_beg, MAGIC, sizeof MAGIC))
+      bad_log();
+   log_pos += sizeof MAGIC;
+   if (take() != sizeof(cell)) {
+      fprintf(stderr, "%s: trace: recorded with a different cell size\n",
+              arg0);
+      exit(2);
+   }
+   if (take_uvarint() != len || take_uvarint() != fnv1a(code, len)) {
+      fprintf(stderr, "%s: trace: recorded with a different program\n", arg0);
+      exit(2);
+   }
+
+   // Find the latest checkpoint at or before the stopping point, if any.
+   const unsigned char *start = log_pos, *ckpt = NULL;
+   while (stop != UINTMAX_MAX && log_pos < log_end) {
+      const unsigned char *rec = log_pos;
+      unsigned char tag = take();
+      if (tag == TAG_CHECKPOINT) {
+         const unsigned char *p = log_pos;
+         if (take_uvarint() > stop)
+            break;
+         log_pos = p;
+         ckpt = rec;
+      }
+      skip_record(tag);
+   }
+
+   if (ckpt) {
+      log_pos = ckpt + 1;
+      const unsigned char *p = log_pos;
+      trace_insns = take_uvarint();
+      log_pos = p;
+      take_checkpoint(st);
+      *restored = true;
+   } else {
+      log_pos = start;
+      prev_pos = MUSHCOORDS2(0,0);
+   }
+
+   mode = REPLAYING;
+   trace_stop_at = stop;
+   return true;
+}
+
+static _Noreturn void diverged(const char *what) {
+   fprintf(stderr, "%s: trace: replay diverges at instruction %ju: %s\n",
+           arg0, trace_insns, what);
+   exit(1);
+}
+
+// Reads records until one that isn't a checkpoint, returning its tag.
+static unsigned char next_record(void) {
+   for (;;) {
+      if (log_pos == log_end)
+         diverged("the log ends");
+      unsigned char tag = take();
+      if (tag != TAG_CHECKPOINT)
+         return tag;
+      take_checkpoint(NULL);
+   }
+}
+
+void trace_pos(mushcoords2 pos) {
+   if (mode == RECORDING) {
+      mushcoords2 d = mushcoords2_sub(pos, prev_pos);
+      if (run_len && (d.x != run_delta.x || d.y != run_delta.y))
+         flush_run();
+      run_delta = d;
+      ++run_len;
+   } else {
+      if (!run_len) {
+         unsigned char tag = next_record();
+         if (tag == TAG_END)
+            diverged("the recorded run ended here");
+         if (tag != TAG_STEP)
+            diverged("expected an instruction, found input");
+         run_len   = take_uvarint();
+         run_delta = take_coords();
+      }
+      --run_len;
+      mushcoords2 expected = MUSHCOORDS2(prev_pos.x + run_delta.x,
+                                         prev_pos.y + run_delta.y);
+      if (pos.x != expected.x || pos.y != expected.y) {
+         char what[128];
+         snprintf(what, sizeof what, "expected ( %ld %ld ), at ( %ld %ld )",
+                  (long)expected.x, (long)expected.y, (long)pos.x, (long)pos.y);
+         diverged(what);
+      }
+   }
+   prev_pos = pos;
+   ++trace_insns;
+}
+
+void trace_input(bool ok, cell c) {
+   flush_run();
+   if (ok) {
+      emit(TAG_INPUT);
+      emit_varint(c);
+   } else
+      emit(TAG_EOF);
+}
+
+bool trace_replay_input(cell *c) {
+   if (run_len)
+      diverged("expected an instruction, found input");
+   switch (next_record()) {
+   case TAG_INPUT: *c = take_varint(); return true;
+   case TAG_EOF:   return false;
+   default:        diverged("expected input, found an instruction");
+   }
+}
+
+void trace_file(bool ok, const unsigned char *data, size_t len) {
+   if (mode == RECORDING) {
+      flush_run();
+      if (ok) {
+         emit(TAG_FILE);
+         emit_uvarint(len);
+         emit_uvarint(fnv1a(data, len));
+      } else
+         emit(TAG_NOFILE);
+      return;
+   }
+
+   if (run_len)
+      diverged("expected an instruction, found a file");
+   switch (next_record()) {
+   case TAG_FILE:
+      if (ok && take_uvarint() == len && take_uvarint() == fnv1a(data, len))
+         return;
+      break;
+   case TAG_NOFILE:
+      if (!ok)
+         return;
+      break;
+   default:
+      diverged("expected a file, found an instruction or input");
+   }
+   diverged("the file differs from the one read when recording");
+}
@@ -0,0 +1,92 @@
+// SPDX-License-Identifier: AGPL-3.0-only
+// This file is part of Hali.
+// File created: 2026-10-19 16:20:05
+
+// Execution traces, enabled with -DTRACE. A recording logs the position of
+// every executed instruction along with every value read by & and ~, which
+// is all that's needed to re-execute the run deterministically. Files read by
+// i are read again, so only their length and hash are logged, to check that
+// they haven't changed. Every
+// TRACE_CHECKPOINT_INTERVAL instructions the whole interpreter state is
+// logged as well, so that a replay can start from the latest checkpoint
+// before the instruction it's interested in instead of from the beginning.
+//
+// The log is a header followed by a stream of tagged records. Positions are
+// delta-encoded against the previous instruction's and run-length encoded,
+// and all numbers are zigzag LEB128 varints, so a straight line of code costs
+// a few bytes per run. The recording is written out by a background thread.
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <mush/space.h>
+
+#include "stack.h"
+
+#ifndef TRACE_CHECKPOINT_INTERVAL
+#define TRACE_CHECKPOINT_INTERVAL (1 << 24)
+#endif
+
+// Checkpoints of Funge-spaces with more cells than this are skipped: they'd
+// be too large to be worth it.
+#ifndef TRACE_CHECKPOINT_MAX_AREA
+#define TRACE_CHECKPOINT_MAX_AREA (1 << 20)
+#endif
+
+// Everything needed to resume execution.
+typedef struct {
+   mushcoords2 pos, delta, offset;
+   bool stringmode, strn_enabled;
+
+   // Bottom to top.
+   size_t nstacks;
+   CellContainer **stacks;
+
+   // The cells within bounds, row by row.
+   mushbounds2 bounds;
+   cell *cells;
+} TraceState;
+
+// The number of instructions recorded or replayed so far, and the number at
+// which trace_stop() should next be called: when the next checkpoint is due
+// or when a replay should stop.
+extern uintmax_t trace_insns, trace_stop_at;
+
+static inline bool trace_stop_due(void) { return trace_insns == trace_stop_at; }
+
+// Recording. The code is used to check that a replay is of the same program.
+bool trace_record_start(
+   const char *arg0, const char *path, const unsigned char *code, size_t len);
+void trace_record_stop(void);
+bool trace_recording(void);
+bool trace_checkpoint_wanted(const mushbounds2*);
+void trace_checkpoint(const TraceState*);
+
+// Replaying. Stops just before instruction number stop, or at the end of the
+// log if stop is UINTMAX_MAX. If there is a checkpoint at or before stop,
+// fills in the state from the latest one and returns true in *restored. The
+// caller owns the allocated memory in the state afterwards.
+bool trace_replay_start(
+   const char *arg0, const char *path, const unsigned char *code, size_t len,
+   uintmax_t stop, TraceState *, bool *restored);
+bool trace_replaying(void);
+
+// Called with the position of every instruction about to be executed. When
+// replaying, exits if the position differs from the recorded one.
+void trace_pos(mushcoords2);
+
+// Called with the result of every & and ~: the value if ok, else EOF was hit.
+void trace_input(bool ok, cell);
+
+// When replaying, gives the recorded result of the current & or ~ instead.
+bool trace_replay_input(cell*);
+
+// Called with the contents of every file read by i, or ok false if it
+// couldn't be. When replaying, exits if they differ from the recorded ones.
+void trace_file(bool ok, const unsigned char *data, size_t len);
+
+#endif